@@ -0,0 +1,282 @@
+#include <arpa/inet.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "icmp.h"
+#include "ping.h"
+
+/*
+ * Microbenchmarks of the packet hot path.  Every case is warmed up, then
+ * timed over BENCH_REPS repetitions of a batch sized to last about
+ * BENCH_REP_NS; the median repetition is reported as ns/op, along with the
+ * fastest one.  Results are JSON Lines, one per case, on stdout.
+ *
+ * Environment: BENCH_CPU pins to another CPU than the current one,
+ * BENCH_REPS overrides the number of repetitions.
+ */
+
+#define BENCH_REPS 15
+#define BENCH_REP_NS 20000000LL     /* duration of one repetition */
+#define BENCH_WARMUP_NS 100000000LL /* warmup of every case */
+
+static volatile uint64_t sink;
+
+typedef struct bench {
+  const char *name;
+  size_t size; /* Bytes processed per op, 0 if not meaningful */
+  void (*run)(struct bench *, size_t n);
+  t_pset *s;
+  unsigned char *buf;
+} t_bench;
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void bench_cksum(t_bench *b, size_t n) {
+  uint64_t acc = 0;
+
+  for (size_t i = 0; i < n; i++)
+    acc += icmp_cksum(b->buf, b->size);
+  sink += acc;
+}
+
+static void bench_encode(t_bench *b, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    icmp_echo_encode(b->buf, b->size, 0x1234, i);
+  sink += b->buf[2];
+}
+
+static void bench_decode(t_bench *b, size_t n) {
+  struct ip *ip;
+  icmphdr_t *icmp;
+  uint64_t acc = 0;
+
+  for (size_t i = 0; i < n; i++)
+    acc += icmp_generic_decode(b->buf, b->size, &ip, &icmp) + icmp->icmp_seq;
+  sink += acc;
+}
+
+/* What send_echo() does short of queueing the packet */
+static void bench_prepare(t_bench *b, size_t n) {
+  t_pset *s = b->s;
+  t_pinfo *p = &s->targets[0];
+  t_pevent ev;
+
+  for (size_t i = 0; i < n; i++) {
+    unsigned char *pkt = pool_slot(s);
+
+    ev.type = EV_SEND;
+    ev.p = p;
+    ev.seq = p->num_sent++;
+    gettimeofday(&ev.tv, NULL);
+    icmp_echo_patch(pkt, ev.seq, &ev.tv, sizeof(ev.tv));
+    ping_event(s, &ev);
+  }
+  sink += p->win.next;
+}
+
+static void bench_print(t_bench *b, size_t n) {
+  t_pset *s = b->s;
+  t_pinfo *p = &s->targets[0];
+  struct ip *ip = (struct ip *)b->buf;
+  icmphdr_t *icmp = (icmphdr_t *)(b->buf + sizeof(*ip));
+  struct sockaddr_in from = p->dst;
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  memcpy(icmp->icmp_data, &now, sizeof(now));
+  now.tv_usec += 123;
+  for (size_t i = 0; i < n; i++)
+    print_echo(s, p, SEQ_OK, &from, ip, icmp, b->size, &now, -1, -1);
+  sink += s->out.len;
+}
+
+/* Sequence window bookkeeping of one probe and its reply */
+static void bench_seqwin(t_bench *b, size_t n) {
+  t_pseqwin *w = &b->s->targets[0].win;
+  struct timeval tv = {0};
+  uint64_t acc = 0;
+
+  for (size_t i = 0; i < n; i++)
+    acc += seqwin_recv(w, seqwin_send(w, &tv, 0));
+  sink += acc;
+}
+
+static void bench_fire(t_wtimer *t, void *arg) {
+  (void)t;
+  (*(size_t *)arg)++;
+}
+
+/*
+ * Reply deadlines of 64k probes in flight: one armed per probe, a quarter
+ * of them left to expire and the others cancelled by their replies, with
+ * the clock ticking every 16 probes.
+ */
+static void bench_wheel(t_bench *b, size_t n) {
+  static t_wtimer timers[65536];
+  t_wheel *w = malloc(sizeof(*w));
+  size_t fired = 0;
+
+  (void)b;
+  if (!w)
+    return;
+  wheel_init(w, 0);
+  memset(timers, 0, sizeof(timers));
+  for (size_t i = 0; i < n; i++) {
+    t_wtimer *t = &timers[i & 0xffff];
+
+    wheel_del(w, t);
+    wheel_add(w, t, w->now + 1000 + (i & 1023));
+    if (i >= 512 && (i & 3))
+      wheel_del(w, &timers[(i - 512) & 0xffff]);
+    if (!(i & 15))
+      wheel_run(w, w->now, bench_fire, &fired);
+  }
+  sink += fired + w->len;
+  free(w);
+}
+
+/*
+ * The whole send loop, pinging one target of the simulated network every
+ * virtual microsecond, quietly.  Setting up the set is part of the cost,
+ * spread over the n probes.
+ */
+static void bench_exec(t_bench *b, size_t n) {
+  t_ftping *s;
+  t_ftstats st;
+  size_t opts;
+  t_popt opt;
+
+  ftping_defaults(&opt, &opts);
+  opt.count = n;
+  opt.interval = 1000;
+  opt.sim = "delay=0.05,jitter=0.01";
+  opt.out_fd = b->s->out.fd;
+  if ((s = ftping_new(&opt, opts | OPT_QUIET)) && !ftping_add(s, "10.0.0.1") &&
+      !ftping_run(s) && !ftping_stats(s, 0, &st))
+    sink += st.received;
+  ftping_free(s);
+}
+
+static void bench_one(t_bench *b, int cpu, int reps) {
+  long long t[BENCH_REPS * 8], start, end;
+  double med, min;
+  size_t n = 1;
+
+  /* Warm up while finding a batch size that lasts one repetition */
+  end = now_ns() + BENCH_WARMUP_NS;
+  do {
+    start = now_ns();
+    b->run(b, n);
+    if (now_ns() - start < BENCH_REP_NS)
+      n *= 2;
+  } while (now_ns() < end);
+
+  for (int i = 0; i < reps; i++) {
+    start = now_ns();
+    b->run(b, n);
+    t[i] = now_ns() - start;
+  }
+  qsort(t, reps, sizeof(*t), cmp_ll);
+
+  med = (double)t[reps / 2] / n;
+  min = (double)t[0] / n;
+  printf("{\"bench\":\"%s\",\"size\":%zu,\"ns_op\":%.3f,\"ns_min\":%.3f,"
+         "\"mops\":%.3f",
+         b->name, b->size, med, min, 1000.0 / med);
+  if (b->size)
+    printf(",\"mbps\":%.1f", b->size * 1000.0 / med);
+  printf(",\"ops\":%zu,\"reps\":%d,\"cpu\":%d}\n", n, reps, cpu);
+  fflush(stdout);
+}
+
+/* One target, its window and an output buffer writing to /dev/null */
+static int bench_set(t_pset *s) {
+  memset(s, 0, sizeof(*s));
+  ftping_defaults(&s->opt, &s->opts);
+  s->fd = s->wakefd = s->stopfd = s->ring.fd = s->pace.fd = -1;
+  s->tp = &sock_transport;
+  s->id = 0x1234;
+  s->data_size = s->opt.data_size;
+  if (!(s->targets = calloc(1, sizeof(*s->targets))))
+    return -1;
+  s->ntargets = 1;
+  s->targets[0].dst.sin_family = AF_INET;
+  s->targets[0].dst.sin_addr.s_addr = htonl(0x7f000001);
+  s->targets[0].hostname = strdup("localhost");
+  if (stat_init(&s->targets[0].stat) || data_init(s) ||
+      seqwin_init(&s->targets[0].win, SEQWIN_DFLT) || pool_init(s) ||
+      ob_init(&s->out, open("/dev/null", O_WRONLY), OBUF_SIZE))
+    return -1;
+  return 0;
+}
+
+int main(void) {
+  static const size_t sizes[] = {64, 256, 1500, 9000};
+  unsigned char buf[9000], pkt[sizeof(struct ip) + 64];
+  int cpu = sched_getcpu(), reps = BENCH_REPS;
+  cpu_set_t set;
+  t_pset s;
+  char *env;
+
+  if ((env = getenv("BENCH_CPU")))
+    cpu = atoi(env);
+  if ((env = getenv("BENCH_REPS")))
+    reps = MIN(MAX(atoi(env), 1), BENCH_REPS * 8);
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set))
+    perror("sched_setaffinity");
+
+  if (bench_set(&s))
+    return EXIT_FAILURE;
+  for (size_t i = 0; i < sizeof(buf); i++)
+    buf[i] = rand();
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+    bench_one(&(t_bench){"icmp_cksum", sizes[i], bench_cksum, &s, buf}, cpu,
+              reps);
+  bench_one(&(t_bench){"icmp_echo_encode", 64, bench_encode, &s, buf}, cpu,
+            reps);
+
+  /* A valid echo reply behind an IP header */
+  memset(pkt, 0, sizeof(pkt));
+  ((struct ip *)pkt)->ip_hl = 5;
+  ((struct ip *)pkt)->ip_ttl = 64;
+  memcpy(pkt + sizeof(struct ip), pool_slot(&s), 64);
+  ((icmphdr_t *)(pkt + sizeof(struct ip)))->icmp_type = ICMP_ECHOREPLY;
+  ((icmphdr_t *)(pkt + sizeof(struct ip)))->icmp_cksum = 0;
+  ((icmphdr_t *)(pkt + sizeof(struct ip)))->icmp_cksum =
+      icmp_cksum(pkt + sizeof(struct ip), 64);
+  bench_one(&(t_bench){"icmp_generic_decode", sizeof(pkt), bench_decode, &s,
+                       pkt},
+            cpu, reps);
+
+  bench_one(&(t_bench){"send_echo_prepare", 0, bench_prepare, &s, NULL}, cpu,
+            reps);
+  bench_one(&(t_bench){"print_echo", sizeof(pkt), bench_print, &s, pkt}, cpu,
+            reps);
+  bench_one(&(t_bench){"seqwin", 0, bench_seqwin, &s, NULL}, cpu, reps);
+  bench_one(&(t_bench){"wheel", 0, bench_wheel, &s, NULL}, cpu, reps);
+  bench_one(&(t_bench){"exec_sim", 0, bench_exec, &s, NULL}, cpu, reps);
+  ping_reset(&s);
+  return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * Capture log: a header, one entry per target, then fixed size records in
+ * the order events were accounted.  All fields are in host byte order.  The
+ * file grows by preallocated segments, so a log cut short by a crash ends
+ * with zeroed records, which have no type.
+ */
+
+#define CAPTURE_MAGIC "FTPCAP\0\1"
+#define CAPTURE_SEGMENT (16 << 20) /* file growth step, multiple of pages */
+
+enum { CAP_NONE, CAP_SEND, CAP_FAIL, CAP_TXTS, CAP_REPLY, CAP_ERROR };
+
+typedef struct capture_hdr {
+  char magic[8];      /* CAPTURE_MAGIC */
+  uint32_t ntargets;  /* Number of target entries that follow */
+  uint32_t data_size; /* Data bytes per probe */
+  uint32_t window;    /* Sequence window per target */
+  uint16_t id;        /* ICMP identifier of the probes */
+  uint16_t pad;
+  int64_t start;      /* Start of the run, ns since the epoch */
+  uint8_t resv[32];
+} t_pcaphdr;
+
+typedef struct capture_target {
+  uint32_t addr; /* Destination, network byte order */
+  char name[60]; /* Host name, truncated */
+} t_pcaptarget;
+
+typedef struct capture_rec {
+  uint8_t type;      /* CAP_ type */
+  uint8_t icmp_type; /* Received packets only */
+  uint8_t icmp_code;
+  uint8_t ttl;
+  uint16_t seq;    /* Sequence number, quoted one for errors */
+  uint16_t len;    /* Packet size, IP header included */
+  uint32_t target; /* Target index */
+  uint32_t from;   /* Source of received packets, network byte order */
+  int64_t time;    /* Time sent or received in userspace, ns */
+  int64_t kts;     /* Kernel timestamp in ns, 0 if none */
+} t_pcaprec;
+
+#endif // CAPTURE_H
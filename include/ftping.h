@@ -0,0 +1,153 @@
+#ifndef FTPING_H
+#define FTPING_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libftping: ping sessions embedded in another program.  A session owns its
+ * sockets, targets, statistics and output; sessions share nothing, so any
+ * number of them may run in one process, each from one thread at a time.
+ *
+ *   t_popt opt;
+ *   ftping_defaults(&opt, &opts);
+ *   s = ftping_new(&opt, opts);
+ *   ftping_add(s, "example.com");
+ *   ftping_run(s);               or ftping_start(), ftping_step()...
+ *   ftping_stats(s, 0, &st);
+ *   ftping_free(s);
+ */
+
+#define OPT_VERBOSE 0x001
+#define OPT_FLOOD 0x002
+#define OPT_NUMERIC 0x004
+#define OPT_QUIET 0x008
+#define OPT_KERNTS 0x010
+#define OPT_THREADS 0x020
+#define OPT_URING 0x040
+
+#define DFLT_INTVL 1000 /* default interval ms */
+#define FLOOD_INTVL 10  /* default interval ms in flood mode */
+#define DATA_SIZE 56    /* default data size */
+#define BATCH_DFLT 64   /* default batch size in flood and preload mode */
+#define SEQWIN_MAX 32768 /* must stay below the 16-bit sequence space */
+#define RTO_MIN_DFLT 200 /* default floor of per-probe timeouts in ms */
+#define RTO_MAX 60000    /* longest per-probe timeout in ms */
+
+/* Structured output formats */
+enum { FMT_HUMAN, FMT_JSON, FMT_CSV };
+
+/* Open loop send schedules */
+enum { OPEN_NONE, OPEN_CONST, OPEN_POISSON, OPEN_BURST };
+
+/* Reply classes */
+enum { SEQ_OK, SEQ_REORD, SEQ_DUP, SEQ_LATE, SEQ_BOGUS };
+
+typedef struct ping_opt {
+  int socket_type;     /* Socket type */
+  unsigned char *data; /* Icmp data, filled in by the session */
+  size_t data_size;    /* Size of data */
+  uint64_t data_sum;   /* Checksum partial sum of the data sent */
+  unsigned char *ptrn; /* Pattern buffer pointer */
+  size_t ptrn_size;    /* Pattern size */
+  size_t count;        /* Number of packets to send */
+  long long interval;  /* Number of ns to wait between sending pkts */
+  size_t rate;         /* Total packets per second, 0 to use interval */
+  uint linger;         /* Number of ms to linger before receiving last packet */
+  uint timeout;        /* Runner timeout in seconds */
+  uint preload;        /* Number of packets to preload */
+  int ttl;             /* Time to live */
+  int tos;             /* Type of service */
+  size_t batch;        /* Packets per sendmmsg/recvmmsg call */
+  size_t window;       /* Sequence window size per target */
+  int format;          /* Output format */
+  int out_fd;          /* Where the output goes, -1 for nowhere */
+  uint report_intvl;   /* Seconds between interval reports, 0 for none */
+  const char *rx_iface; /* Interface to receive from through a ring */
+  const char *dns_cache; /* File caching host name resolutions */
+  const char *capture;   /* Capture log to write */
+  const char *replay;    /* Capture log to analyze instead of pinging */
+  const char *sim;       /* Simulated network spec, if any */
+  size_t shards;         /* Worker threads the targets are spread over */
+  int open_loop;         /* Open loop schedule, OPEN_NONE to skip late slots */
+  size_t burst;          /* Probes per burst of the OPEN_BURST schedule */
+  uint64_t seed;         /* Seed of the OPEN_POISSON schedule, 0 for random */
+  uint rto_min;          /* Floor of per-probe timeouts in ms, 0 for none */
+} t_popt;
+
+typedef struct ping_set t_ftping;
+
+typedef struct ftping_reply {
+  const char *host;    /* Target, as it was added */
+  struct in_addr addr; /* Target address */
+  unsigned short seq;  /* Sequence number */
+  int ttl;             /* Time to live of the reply */
+  unsigned int bytes;  /* ICMP header and data */
+  double rtt;          /* Round trip time in ms, negative if not timed */
+  double irtt;         /* From the intended send time, negative if none */
+  int status;          /* Reply class, SEQ_OK to SEQ_LATE */
+} t_ftreply;
+
+typedef struct ftping_error {
+  const char *host;    /* Target the probe was sent to */
+  struct in_addr addr; /* Target address */
+  struct in_addr from; /* Sender of the error */
+  int type;            /* ICMP type and code */
+  int code;
+  unsigned short seq; /* Sequence number of the probe */
+} t_fterror;
+
+/*
+ * Called from the session's thread as replies and errors are accounted.  A
+ * sharded session calls them from its workers' threads, concurrently, with
+ * the worker as the session.
+ */
+typedef struct ftping_callbacks {
+  void (*reply)(t_ftping *, const t_ftreply *, void *arg);
+  void (*error)(t_ftping *, const t_fterror *, void *arg);
+  void *arg;
+} t_ftcb;
+
+typedef struct ftping_stats {
+  size_t sent;      /* Probes sent */
+  size_t received;  /* Replies in time, duplicates and late ones aside */
+  size_t dup;       /* Duplicate replies */
+  size_t errors;    /* ICMP errors */
+  size_t lost;      /* Probes which left the window unanswered */
+  size_t late;      /* Replies to probes already given up */
+  size_t reordered; /* Replies overtaken by a later one */
+  double min;       /* Round trip times in ms, 0 without timed replies */
+  double avg;
+  double max;
+  double p50;
+  double p90;
+  double p99;
+  double ip50;    /* Open loop: round trips from the intended send times */
+  double ip99;
+  double lag_avg; /* Open loop: sends behind the schedule, ms */
+  double lag_max;
+  double srtt;    /* With per-probe timeouts: smoothed round trip, ms */
+  double rttvar;  /* Its variation */
+  double rto;     /* Timeout of the next probe */
+} t_ftstats;
+
+void ftping_defaults(t_popt *, size_t *opts);
+t_ftping *ftping_new(const t_popt *, size_t opts);
+void ftping_free(t_ftping *);
+void ftping_callbacks(t_ftping *, const t_ftcb *);
+int ftping_add(t_ftping *, const char *host);
+int ftping_load(t_ftping *, const char *path);
+
+int ftping_start(t_ftping *);
+int ftping_step(t_ftping *);
+void ftping_finish(t_ftping *);
+int ftping_run(t_ftping *);
+void ftping_stop(t_ftping *);
+
+size_t ftping_ntargets(t_ftping *);
+int ftping_stats(t_ftping *, size_t target, t_ftstats *);
+
+int ftping_replay(const t_popt *, const char *path);
+
+#endif // FTPING_H
@@ -0,0 +1,37 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram in the spirit of HdrHistogram.  Values are
+ * nanoseconds; every power of two range is split into HIST_SUB linear
+ * buckets, which bounds the relative error of a recorded value to
+ * 1 / HIST_SUB.  Values below 2 * HIST_SUB are recorded exactly.
+ *
+ * The table is allocated once, by hist_init(), so that recording a value
+ * takes constant time and never allocates.  The span of buckets in use is
+ * kept along: the round trips of one target fill a few ranges of it, and
+ * merges, percentiles and resets only go through those.
+ */
+
+#define HIST_SUB_BITS 6  /* log2 of the number of buckets per range */
+#define HIST_MAX_BITS 36 /* largest value is 2^36 ns, about 68 seconds */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct hist {
+  uint64_t count;   /* Number of recorded values */
+  uint64_t *counts; /* HIST_SIZE bucket counters */
+  unsigned int lo;  /* First bucket in use */
+  unsigned int hi;  /* Last bucket in use + 1, lo >= hi if none */
+} t_hist;
+
+int hist_init(t_hist *);
+void hist_reset(t_hist *);
+void hist_add(t_hist *, uint64_t ns);
+void hist_merge(t_hist *dst, const t_hist *src);
+uint64_t hist_percentile(const t_hist *, double pct);
+void hist_free(t_hist *);
+
+#endif // HIST_H
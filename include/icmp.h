@@ -4,6 +4,7 @@
 #include <netinet/in.h>
 #include <netinet/in_systm.h>
 #include <netinet/ip.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 typedef struct icmp_header icmphdr_t;
@@ -125,13 +126,23 @@ struct icmp_header {
 /* N.B.: must separately check that ip_hl >= 5 */
 
 unsigned short icmp_cksum(unsigned char *addr, int len);
+uint64_t icmp_cksum_add(uint64_t sum, const void *addr, size_t len);
+unsigned short icmp_cksum_finish(uint64_t sum);
+unsigned short icmp_cksum_update(unsigned short cksum, const void *old,
+                                 const void *new, size_t len);
 int icmp_generic_encode(unsigned char *buffer, size_t bufsize, int type,
                         int ident, int seqno);
+int icmp_generic_parse(unsigned char *buffer, size_t bufsize, struct ip **ipp,
+                       icmphdr_t **icmpp);
 int icmp_generic_decode(unsigned char *buffer, size_t bufsize, struct ip **ipp,
                         icmphdr_t **icmpp);
 
 int icmp_echo_encode(unsigned char *buffer, size_t bufsize, int ident,
                      int seqno);
+int icmp_echo_encode_sum(unsigned char *buffer, size_t bufsize, int ident,
+                         int seqno, uint64_t datasum);
+void icmp_echo_patch(unsigned char *buffer, int seqno, const void *data,
+                     size_t len);
 int icmp_echo_decode(unsigned char *buffer, size_t bufsize, struct ip **ip,
                      icmphdr_t **icmp);
 #endif // ICMP_H
@@ -0,0 +1,38 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Preallocated output buffer.  Records are formatted in place without stdio
+ * and handed to the kernel with a single write() once the buffer fills up
+ * or the caller decides to flush, typically before going to sleep.
+ */
+
+#define OBUF_SIZE 65536  /* default buffer size */
+#define OBUF_RECORD 1024 /* room guaranteed by ob_reserve() */
+
+typedef struct obuf {
+  char *buf;   /* Buffer memory */
+  size_t len;  /* Bytes pending */
+  size_t size; /* Buffer size */
+  int fd;      /* Where to flush */
+} t_obuf;
+
+int ob_init(t_obuf *, int fd, size_t size);
+void ob_free(t_obuf *);
+int ob_flush(t_obuf *);
+void ob_reserve(t_obuf *, size_t);
+
+void ob_putc(t_obuf *, char);
+void ob_puts(t_obuf *, const char *);
+void ob_putu(t_obuf *, uint64_t);
+void ob_putfix(t_obuf *, double, int decimals);
+void ob_putjstr(t_obuf *, const char *);
+void ob_putip(t_obuf *, struct in_addr);
+void ob_printf(t_obuf *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif // OUTPUT_H
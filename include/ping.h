@@ -1,96 +1,403 @@
 #ifndef PING_H
 #define PING_H
 
+#include "ftping.h"
+#include "hist.h"
 #include "icmp.h"
+#include "output.h"
+#include "wheel.h"
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <time.h>
 
-#define OPT_VERBOSE 0x001
-#define OPT_FLOOD 0x002
-#define OPT_NUMERIC 0x004
-#define OPT_QUIET 0x008
-
-#define DFLT_INTVL 1000 /* default interval ms */
-
-#define DATA_SIZE 56 /* default data size */
-#define CKTAB_SIZE 128
+#define SEQWIN_DFLT 1024 /* default sequence window for a single target */
+#define SEQWIN_MULTI 64  /* default sequence window per target otherwise */
+#define CTL_SIZE 256     /* control buffer for received messages */
+#define PACE_BURST 32    /* most missed send slots caught up back to back */
+#define RING_SIZE 8192   /* events per thread handoff ring, power of 2 */
+#define RXRING_BLOCK (1 << 20) /* receive ring block size */
+#define RXRING_NBLOCKS 16      /* receive ring blocks */
+#define URING_SQ_SIZE 256       /* io_uring submission queue entries */
+#define URING_CQ_SIZE 4096      /* io_uring completion queue entries */
+#define URING_NBUFS 256         /* io_uring receive buffers, power of 2 */
+#define RESOLV_CACHE 256        /* reverse DNS names, power of 2 */
+#define RESOLV_QUEUE 64         /* lookups waiting for the resolver */
+#define DNS_WORKERS 32          /* concurrent host name resolutions */
+#define FILTER_MAX_DST 32      /* destinations checked by the socket filter */
+#define FILTER_MAX (FILTER_MAX_DST + 32) /* socket filter instructions */
+#define RTO_INIT 1000          /* probe timeout in ms before any round trip */
+#define RTO_TICK_SHIFT 20      /* timer wheel ticks of 2^20 ns, about 1 ms */
+#define EV_PKT_SIZE (MAXIPLEN + MAXICMPLEN) /* packet head kept in events */
 #define BUFFER_SIZE(p)                                                         \
   (p->data_size + sizeof(icmphdr_t) + sizeof(struct ip) +                      \
    sizeof(struct timeval))
 
 #define TIMING(s) ((s) >= sizeof(struct timeval))
 
-#define CK_BIT(p, bit) (p)->cktab[(bit) >> 3] /* byte in ck array */
-#define CK_IND(p, bit) (bit % (8 * CKTAB_SIZE))
-#define CK_MASK(bit) (1 << ((bit) & 0x07))
-
-#define CKTAB_SET(p, bit) (CK_BIT(p, CK_IND(p, bit)) |= CK_MASK(CK_IND(p, bit)))
-#define CKTAB_CLR(p, bit)                                                      \
-  (CK_BIT(p, CK_IND(p, bit)) &= ~CK_MASK(CK_IND(p, bit)))
-#define CKTAB_TST(p, bit) (CK_BIT(p, CK_IND(p, bit)) & CK_MASK(CK_IND(p, bit)))
-
-extern size_t opts;
-
-typedef struct ping_opt {
-  int socket_type;     /* Socket type */
-  unsigned char *data; /* Icmp data */
-  size_t data_size;    /* Size of data */
-  unsigned char *ptrn; /* Pattern buffer pointer */
-  size_t ptrn_size;    /* Pattern size */
-  size_t count;        /* Number of packets to send */
-  size_t interval;     /* Number of ms to wait between sending pkts */
-  uint linger;         /* Number of ms to linger before receiving last packet */
-  uint timeout;        /* Runner timeout in seconds */
-  uint preload;        /* Number of packets to preload */
-  int ttl;             /* Time to live */
-  int tos;             /* Type of service */
-} t_popt;
-
-extern t_popt opt_vals;
-
 typedef struct ping_stat {
   double tmin;   /* minimum round trip time */
   double tmax;   /* maximum round trip time */
   double tsum;   /* sum of all times, for doing average */
   double tsumsq; /* sum of all times squared, for std. dev. */
+  double osum;   /* sum of userspace overhead of kernel timed samples */
+  double omax;   /* maximum userspace overhead */
+  size_t nkern;  /* number of samples timed by the kernel */
+  t_hist hist;   /* distribution of round trip times */
 } t_pstat;
 
-extern t_pstat stat;
+/* Probe states */
+enum { PROBE_FREE, PROBE_SENT, PROBE_RECV, PROBE_LOST };
+
+typedef struct ping_seqent {
+  long long sent;      /* Send time, ns since the epoch */
+  long long txts;      /* Kernel transmit timestamp in ns, 0 if none */
+  long long lag;       /* Sent that many ns behind schedule */
+  size_t seq;          /* Extended sequence number */
+  unsigned char state; /* Probe state */
+  t_wtimer timer;      /* Deadline for the reply, with --rto */
+  long long rto;       /* Time allowed for the reply in ns, with --rto */
+  struct ping_info *p; /* Target, once the timer is armed */
+} t_pseqent;
+
+typedef struct ping_seqwin {
+  t_pseqent *ent; /* Outstanding probes, indexed by sequence */
+  size_t size;    /* Number of entries, power of 2 */
+  size_t next;    /* Next extended sequence number to send */
+  size_t top;     /* Highest sequence number answered + 1 */
+  size_t lost;    /* Probes that left the window unanswered */
+  size_t late;    /* Replies to probes already accounted as lost */
+  size_t reord;   /* Replies overtaken by a later one */
+} t_pseqwin;
+
+/* Targets named by host name are pinged once their name resolves */
+enum { TARGET_LIVE, TARGET_PENDING, TARGET_DEAD };
 
 typedef struct ping_info {
-  int fd; /* Raw socket descriptor */
-  int id; /* Our identifier */
   /* Runtime info */
-  char *cktab;
+  t_pseqwin win; /* Outstanding probes */
+
+  char *hostname;         /* Printable hostname */
+  struct sockaddr_in dst; /* Whom to ping */
+  int state;              /* TARGET_PENDING until its name resolves */
+
+  size_t num_sent; /* Sequence numbers used, owned by the sender */
+  size_t num_xmit; /* Number of packets transmitted */
+  size_t num_recv; /* Number of packets received */
+  size_t num_rept; /* Number of duplicates received */
+  size_t num_err;  /* Number of ICMP errors received */
+  t_pstat stat;    /* Round trip statistics */
+  t_pstat *ostat;  /* Round trips from the intended send times, open loop */
+  t_pstat *lag;    /* Send lag behind the schedule, open loop */
+  long long srtt;  /* Smoothed round trip, ns, 0 before the first sample */
+  long long rttvar; /* Round trip variation, ns */
+  long long rto;    /* Timeout of the next probe, ns */
+
+  /* Interval reports */
+  t_pstat *istat;   /* Statistics of the current interval */
+  size_t inum_xmit; /* Counters at the start of the interval */
+  size_t inum_recv;
+  size_t inum_rept;
+  size_t inum_lost;
+} t_pinfo;
+
+typedef struct ping_batch {
+  struct mmsghdr *msgs;      /* Message headers */
+  struct iovec *iovs;        /* One iovec per message */
+  struct sockaddr_in *addrs; /* Source addresses of received messages */
+  unsigned char *bufs;       /* Packet buffers, bufsize bytes each */
+  unsigned char *ctls;       /* Control buffers, CTL_SIZE bytes each */
+  size_t bufsize;            /* Size of one packet buffer */
+  size_t size;               /* Number of slots */
+  size_t len;                /* Number of queued messages */
+} t_pbatch;
+
+/*
+ * Events flow from the network side, which sends and receives packets, to
+ * the accounting side, which owns the sequence windows, the statistics and
+ * the output.  Both sides run in one thread, or in separate ones connected
+ * by rings.
+ */
+enum { EV_SEND, EV_FAIL, EV_TXTS, EV_PKT };
 
-  unsigned char *buffer;   /* I/O buffer */
+typedef struct ping_event {
+  int type;
+  t_pinfo *p;               /* Target the event relates to */
+  unsigned short seq;       /* Sequence number sent, failed or timestamped */
+  struct timeval tv;        /* Time sent, or time received in userspace */
+  struct timespec ts;       /* Kernel timestamp, zero if none */
+  long long lag;            /* Sent that many ns behind schedule */
+  struct sockaddr_in from;  /* Sender of the packet */
+  unsigned int len;         /* Length of the packet */
+  unsigned char pkt[EV_PKT_SIZE]; /* Head of the packet, from the IP header */
+} t_pevent;
+
+/* Single producer, single consumer ring of events */
+typedef struct ping_ring {
+  t_pevent *ev; /* Slots */
+  size_t size;  /* Number of slots, power of 2 */
+  _Atomic size_t head __attribute__((aligned(64))); /* Producer position */
+  _Atomic size_t tail __attribute__((aligned(64))); /* Consumer position */
+} t_pring;
+
+typedef struct ping_rxring {
+  int fd;               /* Packet socket, -1 if the ring is not used */
+  unsigned char *map;   /* Mapped ring */
+  size_t size;          /* Size of the mapping */
+  size_t block_size;    /* Size of a block */
+  size_t nblocks;       /* Number of blocks */
+  size_t cur;           /* Next block to be handed over */
+} t_prxring;
+
+typedef struct ping_pacer {
+  long long start; /* Due time of the first slot, ns */
+  long long num;   /* Slots are num / den ns apart */
+  long long den;
+  size_t slot;     /* Next slot to be used */
+  size_t skipped;  /* Missed slots given up rather than sent in a burst */
+  size_t sent;     /* Slots used */
+  long long first; /* Time the first and the last slot were used */
+  long long last;
+  int fd;          /* Timer descriptor */
+  int sched;       /* Open loop schedule, OPEN_NONE to give up late slots */
+  size_t burst;    /* Slots per burst */
+  uint64_t rand;   /* xorshift64* state of the Poisson schedule */
+  size_t gen;      /* Poisson slots drawn so far */
+  long long due[PACE_BURST]; /* Due times of the last slots drawn */
+} t_pacer;
+
+typedef struct ping_uring t_puring;
+typedef struct ping_resolv t_presolv;
+typedef struct dns_job t_pdnsjob;
+typedef struct ping_capture t_pcapture;
+typedef struct ping_sim t_psim;
+typedef struct ping_transport t_ptransport;
+
+/* Send loop state, between steps */
+typedef struct ping_run {
+  long long intvl;       /* Time to send to every target once, ns */
+  long long report;      /* Interval between reports, ns, 0 for none */
+  long long deadline;    /* Time to give up, 0 for none */
+  long long next;        /* Next send slot, or end of the current wait */
+  long long next_report; /* Time of the next interval report */
+  size_t cursor;         /* Next target in round-robin order */
+  int stopping;          /* 1 once all is sent, 2 while lingering */
+} t_prun;
+
+typedef struct ping_set t_pset;
+
+struct ping_set {
+  size_t opts;            /* OPT_ flags */
+  t_popt opt;             /* Options of the session */
+  t_ftcb cb;              /* Reply and error callbacks */
+  atomic_int stop;        /* Asked to stop by ftping_stop() */
+  t_pacer pace;           /* Send schedule */
+  t_prun run;             /* Send loop state */
+  const t_ptransport *tp; /* Network the probes go through */
+  int fd;    /* Socket descriptor shared by all targets */
+  int id;    /* Our identifier */
+  int dgram; /* Datagram socket: no IP header, errors on the error queue */
+
+  unsigned char *buffer;   /* Receive buffer */
+  unsigned char *pool;     /* Pre-encoded echo requests */
+  size_t npool;            /* Number of packets in the pool */
   size_t data_size;        /* Data size */
-  char *hostname;          /* Printable hostname */
-  struct sockaddr_in dst;  /* Whom to ping */
   struct sockaddr_in from; /* Socket to receive */
+  t_pbatch tx;             /* Outgoing echo requests, if batching */
+  t_pbatch rx;             /* Receive ring, if batching */
+  t_prxring ring;          /* Memory mapped receive ring, if any */
+  t_puring *uring;         /* io_uring backend, if any */
+  t_obuf out;              /* Standard output */
+  t_presolv *resolv;       /* Reverse DNS, unless numeric */
+  t_pdnsjob *dns;          /* Host names still being resolved, if any */
+  t_pcapture *cap;         /* Capture log, if any */
+  t_psim *sim;             /* Simulated network, if any */
+  t_wheel *wheel;          /* Reply deadlines, with --rto */
+
+  /* Thread handoff */
+  t_pring txq;          /* Send events */
+  t_pring rxq;          /* Receive events */
+  int wakefd;           /* Wakes the consumer up */
+  int stopfd;           /* Readable once the threads are to stop */
+  atomic_int sleeping;  /* Consumer waits on wakefd */
+  atomic_int quit;      /* Threads are to stop */
+  atomic_int txdone;    /* Transmit schedule is over */
+
+  t_pinfo *targets;    /* Destinations to ping */
+  size_t ntargets;     /* Number of destinations */
+  size_t *htab;        /* Address hash of targets, index + 1 or 0 if empty */
+  size_t hsize;        /* Number of hash slots, power of 2 */
+  atomic_size_t ndone; /* Number of targets which got all their replies */
+
+  t_pset *shards; /* Workers the targets are spread over, if sharded */
+  size_t nshards;  /* Number of workers */
+  int shard;       /* Worker of a sharded session: no header nor summary */
+  size_t share;    /* Targets sharing the rate, if a worker */
 
   struct timespec start_time; /* Start time */
-  size_t num_xmit;            /* Number of packets transmitted */
-  size_t num_recv;            /* Number of packets received */
-  size_t num_rept;            /* Number of duplicates received */
-} t_pinfo;
+};
+
+/*
+ * Network the engine runs against: the host's sockets, or an in-process
+ * simulation with a virtual clock.  Time is read through the transport, so
+ * that send stamps and receive times come from the same clock.  wait()
+ * sleeps until the given monotonic time, handing whatever arrives to
+ * ping_process(), and returns 1 if the run is to stop.
+ */
+struct ping_transport {
+  long long (*clock)(t_pset *);                  /* Monotonic time, ns */
+  void (*wallclock)(t_pset *, struct timeval *); /* Time stamped in probes */
+  int (*send)(t_pset *, t_pinfo *, unsigned char *pkt, size_t len);
+  int (*flush)(t_pset *); /* Send the transmit batch */
+  int (*wait)(t_pset *, t_pacer *, long long wake);
+};
+
+extern const t_ptransport sock_transport;
+extern const t_ptransport sim_transport;
 
-int ping_init(t_pinfo *);
-void ping_reset(t_pinfo *);
-int ping_recv(t_pinfo *);
-int ping_xmit(t_pinfo *);
+int ping_init(t_pset *, const t_popt *, size_t opts);
+void ping_reset(t_pset *);
+int ping_recv(t_pset *);
+int ping_process(t_pset *, unsigned char *, int, struct sockaddr_in *,
+                 const struct timespec *rxts, const struct timeval *rxtv);
+int ping_xmit(t_pset *, t_pinfo *, unsigned char *);
+void ping_account(t_pset *, t_pevent *);
+long long mono_ns(void);
 int set_dest(t_pinfo *, const char *);
-int data_init();
-int buffer_init(t_pinfo *);
+int data_init(t_pset *);
+int buffer_init(t_pset *);
+
+int batch_init(t_pbatch *, size_t size, size_t bufsize);
+void batch_free(t_pbatch *);
+int batch_queue(t_pset *, t_pinfo *, unsigned char *);
+int batch_flush(t_pset *);
+void batch_fail(t_pset *, size_t i);
+int batch_recv(t_pset *);
+
+int rxring_init(t_pset *, const char *iface);
+void rxring_free(t_prxring *);
+int rxring_recv(t_pset *);
+
+int filter_attach(t_pset *);
+
+int resolv_init(t_pset *);
+void resolv_free(t_pset *);
+const char *resolv_name(t_pset *, struct in_addr, char *buf, size_t size);
+
+int uring_init(t_pset *);
+void uring_free(t_pset *);
+int uring_send(t_pset *);
+int uring_wait(t_pset *, long long wake);
+
+int rto_init(t_pset *);
+void rto_free(t_pset *);
+void rto_arm(t_pset *, t_pinfo *, t_pseqent *);
+void rto_cancel(t_pset *, t_pseqent *);
+void rto_sample(t_pset *, t_pinfo *, long long rtt);
+void rto_run(t_pset *, long long now);
+long long rto_next(t_pset *);
+
+int sim_init(t_pset *, const char *spec);
+void sim_stream(t_pset *, uint64_t stream);
+void sim_free(t_pset *);
+
+int dgram_open(int *id);
+size_t dgram_header(unsigned char *, size_t, struct sockaddr_in *from,
+                    struct msghdr *);
+int dgram_error(t_pset *, struct msghdr *, unsigned char *, size_t);
+
+int pool_init(t_pset *);
+void pool_free(t_pset *);
+unsigned char *pool_slot(t_pset *);
+
+int pace_init(t_pacer *, long long num, long long den);
+void pace_open(t_pacer *, int sched, size_t burst, uint64_t seed);
+void pace_free(t_pacer *);
+long long pace_time(t_pacer *, size_t slot);
+size_t pace_due(t_pacer *, long long now);
+void pace_pass(t_pacer *);
+void pace_sent(t_pacer *, long long now);
+int pace_arm(t_pacer *, long long wake);
+double pace_requested(t_pacer *);
+double pace_achieved(t_pacer *);
+
+int ring_init(t_pring *, size_t size);
+void ring_free(t_pring *);
+int ring_push(t_pring *, const t_pevent *);
+size_t ring_avail(t_pring *);
+t_pevent *ring_peek(t_pring *, size_t i);
+void ring_release(t_pring *, size_t n);
+
+void ping_event(t_pset *, t_pevent *);
+int thread_exec(t_pset *, t_pacer *, int (*run)(t_pset *, t_pacer *));
+
+int seqwin_init(t_pseqwin *, size_t size);
+void seqwin_free(t_pseqwin *);
+unsigned short seqwin_send(t_pseqwin *, const struct timeval *sent,
+                           long long lag);
+t_pseqent *seqwin_find(t_pseqwin *, unsigned short seq);
+t_pseqent *seqwin_next(t_pseqwin *);
+int seqwin_recv(t_pseqwin *, unsigned short seq);
+void seqwin_finish(t_pseqwin *);
+
+int stat_init(t_pstat *);
+void stat_reset(t_pstat *);
+void stat_add(t_pstat *, double triptime);
+void stat_merge(t_pstat *dst, const t_pstat *src);
+double stat_percentile(const t_pstat *, double pct);
+void stat_free(t_pstat *);
+
+int report_init(t_pset *);
+void report_reply(t_pset *, t_pinfo *, struct ip *, icmphdr_t *,
+                  unsigned int datalen, int seqclass, double triptime,
+                  double itriptime);
+void report_error(t_pset *, t_pinfo *, struct sockaddr_in *from, icmphdr_t *);
+void report_timeout(t_pset *, t_pinfo *, t_pseqent *);
+void report_interval(t_pset *);
+void report_summary(t_pset *, t_pinfo *);
+
+int tstamp_init(t_pset *);
+void tstamp_drain(t_pset *);
+int tstamp_rx(struct msghdr *, struct timespec *);
+int tstamp_tx(t_pinfo *, unsigned short seq, long long *);
+
+int target_add(t_pset *, const char *);
+int target_load(t_pset *, const char *);
+int target_index(t_pset *);
+int target_activate(t_pset *, t_pinfo *);
+t_pinfo *target_lookup(t_pset *, in_addr_t);
+
+int dns_resolve(t_pset *);
+int dns_start(t_pset *);
+int dns_poll(t_pset *);
+void dns_free(t_pset *);
+
+int ping_setup(t_pset *);
+int ping_start(t_pset *);
+int ping_step(t_pset *);
+void ping_finish(t_pset *);
+int ping_exec(t_pset *);
+void print_summary(t_pset *);
+void ping_header(t_pset *, t_pinfo *);
+
+int shard_init(t_pset *);
+void shard_free(t_pset *);
+void shard_stop(t_pset *);
+int shard_exec(t_pset *);
 
-int exec(t_pinfo *);
+int capture_open(t_pset *, const char *path);
+void capture_close(t_pset *);
+void capture_event(t_pset *, t_pevent *);
 
-int send_echo(t_pinfo *);
-void print_echo(int dup, struct sockaddr_in *from, struct ip *, icmphdr_t *,
-                unsigned int datalen);
-void print_icmp_header(struct sockaddr_in *from, struct ip *, icmphdr_t *,
-                       unsigned int datalen);
+int send_echo(t_pset *, t_pinfo *, long long due);
+void print_echo(t_pset *, t_pinfo *, int seqclass, struct sockaddr_in *from,
+                struct ip *, icmphdr_t *, unsigned int datalen,
+                const struct timeval *now, double ktrip, double lag);
+void print_timeout(t_pset *, t_pinfo *, t_pseqent *);
+void print_icmp_header(t_pset *, struct sockaddr_in *from, struct ip *,
+                       icmphdr_t *, unsigned int datalen);
 
 #endif // PING_H
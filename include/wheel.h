@@ -0,0 +1,38 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel.  Level 0 has a slot per tick, and a slot of
+ * level n spans a whole turn of level n - 1, over which its timers are
+ * spread when the clock gets there.  Adding and cancelling a timer are O(1)
+ * and a timer moves down at most once per level before it fires.  Timers
+ * are embedded in the objects they belong to.
+ */
+
+#define WHEEL_BITS 8 /* log2 of the number of slots per level */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* 2^32 ticks ahead at most, later timers wait */
+
+typedef struct wheel_timer {
+  struct wheel_timer *next;   /* Next timer of the slot */
+  struct wheel_timer **pprev; /* Link to this one, NULL if not pending */
+  uint64_t expire;            /* Tick to fire at */
+} t_wtimer;
+
+typedef struct wheel {
+  t_wtimer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t now; /* Next tick to run */
+  size_t len;   /* Number of pending timers */
+} t_wheel;
+
+void wheel_init(t_wheel *, uint64_t now);
+void wheel_add(t_wheel *, t_wtimer *, uint64_t expire);
+void wheel_del(t_wheel *, t_wtimer *);
+void wheel_run(t_wheel *, uint64_t now, void (*fire)(t_wtimer *, void *),
+               void *arg);
+uint64_t wheel_next(t_wheel *);
+
+#endif // WHEEL_H
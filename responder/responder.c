@@ -0,0 +1,506 @@
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "icmp.h"
+
+/*
+ * ICMP echo responder for load tests.  Worker threads share the requests
+ * seen on one interface through a packet fanout group, and answer them
+ * from raw sockets with sendmmsg().  Replies can be lost, duplicated,
+ * delayed with jitter and reordered like netem does, or replaced by the
+ * ICMP error cycle of test_server.py.
+ *
+ * The kernel answers echo requests as well; -K silences it for the
+ * duration of the run.
+ */
+
+#define RESP_BATCH 64       /* packets per recvmmsg/sendmmsg call */
+#define RESP_PKT_MAX 1500   /* largest request answered */
+#define RESP_QUEUE 4096     /* delayed replies per worker */
+#define RESP_TICK_NS 100000000LL /* longest sleep, to notice a stop */
+#define ECHO_IGNORE "/proc/sys/net/ipv4/icmp_echo_ignore_all"
+
+#define NITEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct resp_opts {
+  const char *iface;
+  int workers;
+  int fanout;          /* PACKET_FANOUT_ mode */
+  int errors;          /* Cycle through the error responses */
+  int kernel;          /* Silence the kernel's own replies */
+  long long delay;     /* Fixed delay, ns */
+  long long jitter;    /* Random extra delay up to, ns */
+  double loss;         /* Probabilities, 0 to 1 */
+  double dup;
+  double reorder;
+} t_ropts;
+
+/* One reply waiting for its time */
+typedef struct resp_pkt {
+  long long due;
+  struct sockaddr_in dst;
+  size_t len;
+  unsigned char data[RESP_PKT_MAX + 28];
+} t_rpkt;
+
+typedef struct resp_stats {
+  size_t received;
+  size_t replied;
+  size_t lost;
+  size_t duplicated;
+  size_t reordered;
+  size_t errors;
+  size_t overflow;
+} t_rstats;
+
+typedef struct resp_worker {
+  pthread_t tid;
+  int rx;           /* Packet socket, member of the fanout group */
+  int tx;           /* Raw socket, headers included */
+  uint64_t rand;    /* xorshift state */
+  t_rpkt *queue;    /* Min heap of delayed replies, by due time */
+  size_t nqueue;
+  t_rpkt *out;      /* Replies to send now */
+  size_t nout;
+  t_rstats stats;
+} t_rworker;
+
+static const struct {
+  unsigned char type, code;
+} cycle[] = {
+    {ICMP_ECHOREPLY, 0},
+    {ICMP_DEST_UNREACH, ICMP_NET_UNREACH},
+    {ICMP_DEST_UNREACH, ICMP_HOST_UNREACH},
+    {ICMP_DEST_UNREACH, ICMP_PROT_UNREACH},
+    {ICMP_DEST_UNREACH, ICMP_PORT_UNREACH},
+    {ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED},
+    {ICMP_DEST_UNREACH, ICMP_NET_ANO},
+    {ICMP_DEST_UNREACH, ICMP_HOST_ANO},
+    {ICMP_DEST_UNREACH, ICMP_PKT_FILTERED},
+    {ICMP_SOURCE_QUENCH, 0},
+    {ICMP_REDIRECT, ICMP_REDIR_NET},
+    {ICMP_REDIRECT, ICMP_REDIR_HOST},
+    {ICMP_TIME_EXCEEDED, ICMP_EXC_TTL},
+    {ICMP_TIME_EXCEEDED, ICMP_EXC_FRAGTIME},
+    {ICMP_PARAMETERPROB, 0},
+    {ICMP_PARAMETERPROB, 1},
+};
+
+static t_ropts ropts = {.iface = "lo", .fanout = PACKET_FANOUT_LB};
+static atomic_int quit;
+static atomic_size_t next_cycle;
+
+/* Incoming ICMP echo requests only, our replies are seen too on loopback */
+static struct sock_filter filter_code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 4, 0),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct ip, ip_p)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 2),
+    BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+    BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0xffff),
+};
+
+static long long mono_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Uniform in [0, 1) */
+static double rnd(t_rworker *w) {
+  w->rand ^= w->rand << 13;
+  w->rand ^= w->rand >> 7;
+  w->rand ^= w->rand << 17;
+  return (w->rand >> 11) * (1.0 / (1ULL << 53));
+}
+
+static void heap_push(t_rworker *w, const t_rpkt *pkt) {
+  size_t i = w->nqueue++;
+
+  while (i && w->queue[(i - 1) / 2].due > pkt->due) {
+    w->queue[i] = w->queue[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  w->queue[i] = *pkt;
+}
+
+static void heap_pop(t_rworker *w, t_rpkt *pkt) {
+  t_rpkt *last = &w->queue[--w->nqueue];
+  size_t i = 0, c;
+
+  *pkt = w->queue[0];
+  while ((c = 2 * i + 1) < w->nqueue) {
+    if (c + 1 < w->nqueue && w->queue[c + 1].due < w->queue[c].due)
+      c++;
+    if (last->due <= w->queue[c].due)
+      break;
+    w->queue[i] = w->queue[c];
+    i = c;
+  }
+  w->queue[i] = *last;
+}
+
+static void flush(t_rworker *w) {
+  struct mmsghdr msgs[RESP_BATCH];
+  struct iovec iovs[RESP_BATCH];
+  size_t off = 0;
+  int n;
+
+  for (size_t i = 0; i < w->nout; i++) {
+    iovs[i] = (struct iovec){w->out[i].data, w->out[i].len};
+    msgs[i].msg_hdr = (struct msghdr){.msg_name = &w->out[i].dst,
+                                      .msg_namelen = sizeof(w->out[i].dst),
+                                      .msg_iov = &iovs[i],
+                                      .msg_iovlen = 1};
+  }
+  while (off < w->nout) {
+    if ((n = sendmmsg(w->tx, msgs + off, w->nout - off, 0)) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    w->stats.replied += n;
+    off += n;
+  }
+  w->nout = 0;
+}
+
+/* Send now, or queue until due */
+static void emit(t_rworker *w, const t_rpkt *pkt) {
+  if (pkt->due && w->nqueue < RESP_QUEUE) {
+    heap_push(w, pkt);
+    return;
+  }
+  if (pkt->due)
+    w->stats.overflow++;
+  w->out[w->nout] = *pkt;
+  if (++w->nout == RESP_BATCH)
+    flush(w);
+}
+
+/*
+ * Reply to the request in buf: an echo reply made by patching the request,
+ * or an error quoting its IP header and first 8 bytes of data.
+ */
+static int build(const unsigned char *buf, size_t n, t_rpkt *pkt) {
+  const struct ip *req = (const struct ip *)buf;
+  size_t hlen = req->ip_hl << 2, i = atomic_fetch_add(&next_cycle, 1);
+  unsigned char type = ICMP_ECHOREPLY, code = 0;
+  struct ip *ip = (struct ip *)pkt->data;
+  icmphdr_t *icmp = (icmphdr_t *)(ip + 1);
+  unsigned short old, new;
+
+  if (n < hlen + ICMP_MINLEN || req->ip_v != 4 || hlen < sizeof(*req) ||
+      n > RESP_PKT_MAX)
+    return -1;
+  if (ropts.errors) {
+    type = cycle[i % NITEMS(cycle)].type;
+    code = cycle[i % NITEMS(cycle)].code;
+  }
+
+  memset(ip, 0, sizeof(*ip));
+  ip->ip_v = 4;
+  ip->ip_hl = sizeof(*ip) >> 2;
+  ip->ip_ttl = 64;
+  ip->ip_p = IPPROTO_ICMP;
+  ip->ip_src = req->ip_dst;
+  ip->ip_dst = req->ip_src;
+  pkt->dst = (struct sockaddr_in){.sin_family = AF_INET, .sin_addr = req->ip_src};
+
+  if (type == ICMP_ECHOREPLY) {
+    memcpy(icmp, buf + hlen, n - hlen);
+    old = *(unsigned short *)icmp;
+    icmp->icmp_type = ICMP_ECHOREPLY;
+    new = *(unsigned short *)icmp;
+    icmp->icmp_cksum = icmp_cksum_update(icmp->icmp_cksum, &old, &new, 2);
+    pkt->len = sizeof(*ip) + n - hlen;
+  } else {
+    memset(icmp, 0, ICMP_MINLEN);
+    icmp->icmp_type = type;
+    icmp->icmp_code = code;
+    memcpy(icmp->icmp_data, buf, hlen + 8);
+    pkt->len = sizeof(*ip) + ICMP_MINLEN + hlen + 8;
+    icmp->icmp_cksum = icmp_cksum((unsigned char *)icmp, ICMP_MINLEN + hlen + 8);
+  }
+  ip->ip_len = htons(pkt->len);
+  return type != ICMP_ECHOREPLY;
+}
+
+static void answer(t_rworker *w, const unsigned char *buf, size_t n,
+                   long long now) {
+  t_rpkt pkt;
+  int rc;
+
+  w->stats.received++;
+  if ((rc = build(buf, n, &pkt)) < 0)
+    return;
+  w->stats.errors += rc;
+  if (ropts.loss && rnd(w) < ropts.loss) {
+    w->stats.lost++;
+    return;
+  }
+  pkt.due = 0;
+  if (ropts.reorder && rnd(w) < ropts.reorder)
+    w->stats.reordered++;
+  else if (ropts.delay || ropts.jitter)
+    pkt.due = now + ropts.delay + (long long)(rnd(w) * ropts.jitter);
+  emit(w, &pkt);
+  if (ropts.dup && rnd(w) < ropts.dup) {
+    w->stats.duplicated++;
+    emit(w, &pkt);
+  }
+}
+
+static void *worker_main(void *arg) {
+  t_rworker *w = arg;
+  static __thread unsigned char bufs[RESP_BATCH][RESP_PKT_MAX];
+  struct mmsghdr msgs[RESP_BATCH];
+  struct iovec iovs[RESP_BATCH];
+  struct pollfd pfd = {.fd = w->rx, .events = POLLIN};
+  long long now, wait;
+  t_rpkt pkt;
+  int n;
+
+  for (int i = 0; i < RESP_BATCH; i++) {
+    iovs[i] = (struct iovec){bufs[i], sizeof(bufs[i])};
+    msgs[i].msg_hdr = (struct msghdr){.msg_iov = &iovs[i], .msg_iovlen = 1};
+  }
+  while (!atomic_load(&quit)) {
+    now = mono_ns();
+    wait = w->nqueue ? MAX(w->queue[0].due - now, 0) : RESP_TICK_NS;
+    wait = MIN(wait, RESP_TICK_NS);
+    if (wait &&
+        ppoll(&pfd, 1,
+              &(struct timespec){wait / 1000000000LL, wait % 1000000000LL},
+              NULL) < 0 &&
+        errno != EINTR)
+      break;
+
+    now = mono_ns();
+    while ((n = recvmmsg(w->rx, msgs, RESP_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+      for (int i = 0; i < n; i++)
+        answer(w, bufs[i], MIN(msgs[i].msg_len, RESP_PKT_MAX), now);
+      if (n < RESP_BATCH)
+        break;
+    }
+    while (w->nqueue && w->queue[0].due <= now) {
+      heap_pop(w, &pkt);
+      pkt.due = 0;
+      emit(w, &pkt);
+    }
+    if (w->nout)
+      flush(w);
+  }
+  return NULL;
+}
+
+static int worker_init(t_rworker *w, int ifindex, int group) {
+  struct sock_fprog prog = {NITEMS(filter_code), filter_code};
+  struct sockaddr_ll sll = {.sll_family = AF_PACKET,
+                            .sll_protocol = htons(ETH_P_IP),
+                            .sll_ifindex = ifindex};
+  int fanout = group | ropts.fanout << 16, one = 1, size = 4 << 20;
+
+  w->rand = 0x9e3779b97f4a7c15ULL ^ (uintptr_t)w ^ mono_ns();
+  if (!(w->queue = malloc(RESP_QUEUE * sizeof(*w->queue))) ||
+      !(w->out = malloc(RESP_BATCH * sizeof(*w->out))))
+    return -1;
+  /* Bound before the filter applies would let anything in: attach first */
+  if ((w->rx = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP))) < 0 ||
+      setsockopt(w->rx, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) ||
+      bind(w->rx, (struct sockaddr *)&sll, sizeof(sll)) ||
+      setsockopt(w->rx, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)))
+    return -1;
+  setsockopt(w->rx, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  if ((w->tx = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0 ||
+      setsockopt(w->tx, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)))
+    return -1;
+  setsockopt(w->tx, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  return 0;
+}
+
+/* Current kernel setting, or -1 when it cannot be read */
+static int kernel_echo_get(void) {
+  char c;
+  int fd, v = -1;
+
+  if ((fd = open(ECHO_IGNORE, O_RDONLY)) < 0)
+    return -1;
+  if (read(fd, &c, 1) == 1)
+    v = c - '0';
+  close(fd);
+  return v;
+}
+
+static int kernel_echo_set(int ignore) {
+  int fd, rc = -1;
+
+  if ((fd = open(ECHO_IGNORE, O_WRONLY)) < 0)
+    return -1;
+  if (write(fd, ignore ? "1" : "0", 1) == 1)
+    rc = 0;
+  close(fd);
+  return rc;
+}
+
+static double parse_num(const char *arg, double max) {
+  char *end;
+  double v = strtod(arg, &end);
+
+  if (*end || v < 0 || v > max)
+    error(EXIT_FAILURE, 0, "invalid argument: '%s'", arg);
+  return v;
+}
+
+static void usage(void) {
+  printf("Usage: ft_responder [options] [iface]\n"
+         "Answer ICMP echo requests seen on iface (default lo).\n\n"
+         "  -j <n>      worker threads (default: one per CPU)\n"
+         "  -d <ms>     delay every reply\n"
+         "  -J <ms>     add a random delay up to <ms>\n"
+         "  -l <pct>    drop replies\n"
+         "  -D <pct>    send replies twice\n"
+         "  -r <pct>    send replies at once, ahead of the delayed ones\n"
+         "  -e          cycle through ICMP error responses\n"
+         "  -f <mode>   spread requests by hash, lb or cpu (default lb)\n"
+         "  -K          silence the kernel's own echo replies\n"
+         "  -h          print this help\n");
+}
+
+static void parse_args(int argc, char *argv[]) {
+  int opt;
+
+  ropts.workers = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "d:D:ef:hj:J:Kl:r:")) != -1) {
+    switch (opt) {
+    case 'd':
+      ropts.delay = parse_num(optarg, 3600000) * 1000000;
+      break;
+    case 'D':
+      ropts.dup = parse_num(optarg, 100) / 100;
+      break;
+    case 'e':
+      ropts.errors = 1;
+      break;
+    case 'f':
+      if (!strcmp(optarg, "hash"))
+        ropts.fanout = PACKET_FANOUT_HASH;
+      else if (!strcmp(optarg, "lb"))
+        ropts.fanout = PACKET_FANOUT_LB;
+      else if (!strcmp(optarg, "cpu"))
+        ropts.fanout = PACKET_FANOUT_CPU;
+      else
+        error(EXIT_FAILURE, 0, "invalid fanout mode: '%s'", optarg);
+      break;
+    case 'h':
+      usage();
+      exit(0);
+    case 'j':
+      ropts.workers = parse_num(optarg, 1024);
+      break;
+    case 'J':
+      ropts.jitter = parse_num(optarg, 3600000) * 1000000;
+      break;
+    case 'K':
+      ropts.kernel = 1;
+      break;
+    case 'l':
+      ropts.loss = parse_num(optarg, 100) / 100;
+      break;
+    case 'r':
+      ropts.reorder = parse_num(optarg, 100) / 100;
+      break;
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind < argc)
+    ropts.iface = argv[optind];
+  ropts.workers = MAX(ropts.workers, 1);
+}
+
+int main(int argc, char *argv[]) {
+  t_rworker *workers;
+  t_rstats total = {0};
+  sigset_t sigs;
+  int ifindex, prev = -1, sig, started = 0;
+
+  parse_args(argc, argv);
+  if (!(ifindex = if_nametoindex(ropts.iface)))
+    error(EXIT_FAILURE, errno, "%s", ropts.iface);
+  if (!(workers = calloc(ropts.workers, sizeof(*workers))))
+    error(EXIT_FAILURE, errno, "calloc");
+
+  /* Workers inherit the mask: only sigwait() below sees the signals */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  for (int i = 0; i < ropts.workers; i++)
+    if (worker_init(&workers[i], ifindex, getpid() & 0xffff))
+      error(EXIT_FAILURE, errno, "worker %d", i);
+  prev = kernel_echo_get();
+  if (ropts.kernel && prev == 0 && kernel_echo_set(1))
+    error(EXIT_FAILURE, errno, ECHO_IGNORE);
+  else if (!ropts.kernel && prev == 0)
+    fprintf(stderr, "ft_responder: warning: the kernel answers echo "
+                    "requests too, see -K\n");
+  for (; started < ropts.workers; started++)
+    if (pthread_create(&workers[started].tid, NULL, worker_main,
+                       &workers[started]))
+      break;
+  printf("answering on %s with %d workers%s\n", ropts.iface, started,
+         ropts.errors ? ", error cycle" : "");
+  fflush(stdout);
+
+  sigwait(&sigs, &sig);
+  atomic_store(&quit, 1);
+  for (int i = 0; i < started; i++) {
+    t_rstats *st = &workers[i].stats;
+
+    pthread_join(workers[i].tid, NULL);
+    total.received += st->received;
+    total.replied += st->replied;
+    total.lost += st->lost;
+    total.duplicated += st->duplicated;
+    total.reordered += st->reordered;
+    total.errors += st->errors;
+    total.overflow += st->overflow;
+  }
+  if (ropts.kernel && prev == 0)
+    kernel_echo_set(0);
+  printf("%zu requests, %zu replies sent, %zu errors, %zu lost, "
+         "%zu duplicated, %zu reordered, %zu queue overflows\n",
+         total.received, total.replied, total.errors, total.lost,
+         total.duplicated, total.reordered, total.overflow);
+  return 0;
+}
@@ -0,0 +1,106 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "ping.h"
+
+int batch_init(t_pbatch *b, size_t size, size_t bufsize) {
+  memset(b, 0, sizeof(*b));
+  if (!(b->msgs = calloc(size, sizeof(*b->msgs))) ||
+      !(b->iovs = calloc(size, sizeof(*b->iovs))) ||
+      !(b->addrs = calloc(size, sizeof(*b->addrs))) ||
+      (bufsize && !(b->bufs = calloc(size, bufsize))) ||
+      !(b->ctls = calloc(size, CTL_SIZE))) {
+    batch_free(b);
+    return -1;
+  }
+  b->size = size;
+  b->bufsize = bufsize;
+  for (size_t i = 0; i < size; i++) {
+    b->iovs[i].iov_base = b->bufs + i * bufsize;
+    b->iovs[i].iov_len = bufsize;
+    b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+  }
+  return 0;
+}
+
+void batch_free(t_pbatch *b) {
+  free(b->msgs);
+  free(b->iovs);
+  free(b->addrs);
+  free(b->bufs);
+  free(b->ctls);
+  memset(b, 0, sizeof(*b));
+}
+
+/*
+ * Queue the echo request in pkt for target p.  The queue is sent as soon as
+ * it fills up, otherwise the caller is expected to batch_flush() before
+ * going back to sleep.  The packet is referenced, not copied.
+ */
+int batch_queue(t_pset *s, t_pinfo *p, unsigned char *pkt) {
+  t_pbatch *b = &s->tx;
+  struct msghdr *hdr = &b->msgs[b->len].msg_hdr;
+
+  b->iovs[b->len].iov_base = pkt;
+  b->iovs[b->len].iov_len = s->data_size + 8;
+  hdr->msg_name = &p->dst;
+  hdr->msg_namelen = sizeof(p->dst);
+
+  if (++b->len == b->size)
+    return batch_flush(s);
+  return 0;
+}
+
+/* Send the queued requests through the transport, and empty the queue */
+int batch_flush(t_pset *s) { return s->tp->flush(s); }
+
+/*
+ * Queued request i was refused by the kernel.  Like a failed ping_xmit(),
+ * it then has nothing left to wait for.
+ */
+void batch_fail(t_pset *s, size_t i) {
+  struct msghdr *hdr = &s->tx.msgs[i].msg_hdr;
+  t_pevent ev = {
+      .type = EV_FAIL,
+      .p = (t_pinfo *)((char *)hdr->msg_name - offsetof(t_pinfo, dst)),
+      .seq = ((icmphdr_t *)s->tx.iovs[i].iov_base)->icmp_seq};
+
+  ping_event(s, &ev);
+}
+
+/* Drain every pending reply from the socket */
+int batch_recv(t_pset *s) {
+  t_pbatch *b = &s->rx;
+  int n, total = 0;
+
+  do {
+    for (size_t i = 0; i < b->size; i++) {
+      b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+      b->msgs[i].msg_hdr.msg_control = b->ctls + i * CTL_SIZE;
+      b->msgs[i].msg_hdr.msg_controllen = CTL_SIZE;
+    }
+
+    n = recvmmsg(s->fd, b->msgs, b->size, MSG_DONTWAIT, NULL);
+    if (n < 0)
+      return total ? total : -1;
+
+    for (int i = 0; i < n; i++) {
+      struct msghdr *hdr = &b->msgs[i].msg_hdr;
+      unsigned char *buf = b->bufs + i * b->bufsize;
+      size_t len = b->msgs[i].msg_len;
+      struct timespec rxts;
+      int ts = tstamp_rx(hdr, &rxts);
+
+      if (s->dgram)
+        len = dgram_header(buf, len, &b->addrs[i], hdr);
+      ping_process(s, buf, len, &b->addrs[i], ts ? &rxts : NULL, NULL);
+    }
+    total += n;
+  } while ((size_t)n == b->size);
+  return total;
+}
@@ -0,0 +1,153 @@
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "ping.h"
+
+/*
+ * Capture writer.  The current segment of the log is mapped and records
+ * are stored into it directly; once it is full the file is extended by
+ * another preallocated segment, which is mapped in turn.
+ */
+
+_Static_assert(sizeof(t_pcaphdr) == 64, "capture header layout");
+_Static_assert(sizeof(t_pcaptarget) == 64, "capture target layout");
+_Static_assert(sizeof(t_pcaprec) == 32, "capture record layout");
+_Static_assert(CAPTURE_SEGMENT % sizeof(t_pcaprec) == 0, "segment size");
+
+struct ping_capture {
+  int fd;
+  unsigned char *map; /* Current segment */
+  off_t base;         /* Offset of the segment in the file */
+  size_t used;        /* Bytes written in the segment */
+};
+
+static int capture_map(t_pcapture *c, off_t base) {
+  int rc;
+
+  if (c->map)
+    munmap(c->map, CAPTURE_SEGMENT);
+  c->map = NULL;
+  if ((rc = posix_fallocate(c->fd, base, CAPTURE_SEGMENT))) {
+    errno = rc;
+    return -1;
+  }
+  c->map = mmap(NULL, CAPTURE_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED,
+                c->fd, base);
+  if (c->map == MAP_FAILED) {
+    c->map = NULL;
+    return -1;
+  }
+  c->base = base;
+  c->used = 0;
+  return 0;
+}
+
+static void *capture_reserve(t_pcapture *c, size_t n) {
+  void *p;
+
+  if (c->used + n > CAPTURE_SEGMENT &&
+      capture_map(c, c->base + CAPTURE_SEGMENT)) {
+    perror("capture failed");
+    return NULL;
+  }
+  p = c->map + c->used;
+  c->used += n;
+  return p;
+}
+
+int capture_open(t_pset *s, const char *path) {
+  size_t window = s->ntargets ? s->targets[0].win.size : 0;
+  t_pcapture *c;
+  t_pcaphdr *h;
+  struct timespec now;
+
+  if (!(s->cap = c = calloc(1, sizeof(*c))) ||
+      (c->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+      capture_map(c, 0))
+    goto err;
+
+  h = capture_reserve(c, sizeof(*h));
+  memcpy(h->magic, CAPTURE_MAGIC, sizeof(h->magic));
+  h->ntargets = s->ntargets;
+  h->data_size = s->data_size;
+  h->window = window;
+  h->id = s->id;
+  clock_gettime(CLOCK_REALTIME, &now);
+  h->start = now.tv_sec * 1000000000LL + now.tv_nsec;
+  for (size_t i = 0; i < s->ntargets; i++) {
+    t_pcaptarget *t = capture_reserve(c, sizeof(*t));
+
+    if (!t)
+      return -1;
+    t->addr = s->targets[i].dst.sin_addr.s_addr;
+    strncpy(t->name, s->targets[i].hostname, sizeof(t->name) - 1);
+  }
+  return 0;
+err:
+  perror(path);
+  return -1;
+}
+
+/* Drop the unused part of the last segment */
+void capture_close(t_pset *s) {
+  t_pcapture *c = s->cap;
+
+  if (!c)
+    return;
+  if (c->map) {
+    munmap(c->map, CAPTURE_SEGMENT);
+    if (ftruncate(c->fd, c->base + c->used))
+      perror("capture failed");
+  }
+  if (c->fd >= 0)
+    close(c->fd);
+  free(c);
+  s->cap = NULL;
+}
+
+void capture_event(t_pset *s, t_pevent *ev) {
+  t_pcaprec *r = capture_reserve(s->cap, sizeof(*r));
+  struct ip *ip = (struct ip *)ev->pkt;
+  icmphdr_t *icmp;
+
+  if (!r)
+    return;
+  r->target = ev->p - s->targets;
+  r->seq = ev->seq;
+  switch (ev->type) {
+  case EV_SEND:
+    r->type = CAP_SEND;
+    r->time = ev->tv.tv_sec * 1000000000LL + ev->tv.tv_usec * 1000LL;
+    return;
+  case EV_FAIL:
+    r->type = CAP_FAIL;
+    return;
+  case EV_TXTS:
+    r->type = CAP_TXTS;
+    r->kts = ev->ts.tv_sec * 1000000000LL + ev->ts.tv_nsec;
+    return;
+  }
+
+  icmp = (icmphdr_t *)(ev->pkt + (ip->ip_hl << 2));
+  r->icmp_type = icmp->icmp_type;
+  r->icmp_code = icmp->icmp_code;
+  r->ttl = ip->ip_ttl;
+  r->len = ev->len;
+  r->from = ev->from.sin_addr.s_addr;
+  r->time = ev->tv.tv_sec * 1000000000LL + ev->tv.tv_usec * 1000LL;
+  r->kts = ev->ts.tv_sec * 1000000000LL + ev->ts.tv_nsec;
+  if (icmp->icmp_type == ICMP_ECHOREPLY) {
+    r->type = CAP_REPLY;
+    r->seq = icmp->icmp_seq;
+  } else {
+    r->type = CAP_ERROR;
+    r->seq = ((icmphdr_t *)(&icmp->icmp_ip + 1))->icmp_seq;
+  }
+}
@@ -0,0 +1,109 @@
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ping.h"
+
+/*
+ * ICMP datagram ("ping") sockets.  They need no privilege; the kernel picks
+ * the identifier, sets it and the checksum on the way out, and only queues
+ * verified replies to that identifier.  Replies come without their IP
+ * header and errors come on the error queue, so both are given a synthetic
+ * IP header and fed to ping_process() like raw packets.
+ */
+
+int dgram_open(int *id) {
+  struct sockaddr_in addr = {.sin_family = AF_INET};
+  socklen_t len = sizeof(addr);
+  int fd, one = 1;
+
+  if ((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP)) < 0)
+    return -1;
+  if (setsockopt(fd, IPPROTO_IP, IP_RECVERR, &one, sizeof(one)) < 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_RECVTTL, &one, sizeof(one)) < 0 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+    close(fd);
+    return -1;
+  }
+  /* The identifier goes on the wire as the port, in network order */
+  *id = addr.sin_port;
+  return fd;
+}
+
+static void dgram_iphdr(struct ip *ip, size_t len, struct in_addr src,
+                        struct in_addr dst, int ttl) {
+  memset(ip, 0, sizeof(*ip));
+  ip->ip_v = 4;
+  ip->ip_hl = sizeof(*ip) >> 2;
+  ip->ip_len = htons(len);
+  ip->ip_ttl = ttl;
+  ip->ip_p = IPPROTO_ICMP;
+  ip->ip_src = src;
+  ip->ip_dst = dst;
+}
+
+/*
+ * Prepend an IP header to the n bytes of ICMP received right after it, at
+ * buf + sizeof(struct ip).  Returns the length of the whole packet.
+ */
+size_t dgram_header(unsigned char *buf, size_t n, struct sockaddr_in *from,
+                    struct msghdr *msg) {
+  struct cmsghdr *cmsg;
+  int ttl = 0;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TTL)
+      memcpy(&ttl, CMSG_DATA(cmsg), sizeof(ttl));
+  n += sizeof(struct ip);
+  dgram_iphdr((struct ip *)buf, n, from->sin_addr, (struct in_addr){0}, ttl);
+  return n;
+}
+
+/*
+ * ICMP error from the error queue: msg names the destination of the probe,
+ * whose ICMP header and data are the n bytes in data.  Rebuild the error
+ * as it was received.  Returns 0 if the message is not an ICMP error.
+ */
+int dgram_error(t_pset *s, struct msghdr *msg, unsigned char *data, size_t n) {
+  unsigned char buf[2 * sizeof(struct ip) + ICMP_MINLEN + EV_PKT_SIZE];
+  struct sock_extended_err *ee = NULL;
+  struct sockaddr_in *dst = msg->msg_name;
+  struct sockaddr_in from = {.sin_family = AF_INET};
+  struct cmsghdr *cmsg;
+  icmphdr_t *icmp;
+  size_t len;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR)
+      ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+  if (!ee || ee->ee_origin != SO_EE_ORIGIN_ICMP)
+    return 0;
+  /* The receive ring sees the error itself */
+  if (s->ring.fd >= 0)
+    return 1;
+
+  if (SO_EE_OFFENDER(ee)->sa_family == AF_INET)
+    memcpy(&from, SO_EE_OFFENDER(ee), sizeof(from));
+  n = MIN(n, EV_PKT_SIZE);
+  len = 2 * sizeof(struct ip) + ICMP_MINLEN + n;
+
+  dgram_iphdr((struct ip *)buf, len, from.sin_addr, (struct in_addr){0}, 0);
+  icmp = (icmphdr_t *)(buf + sizeof(struct ip));
+  memset(icmp, 0, ICMP_MINLEN);
+  icmp->icmp_type = ee->ee_type;
+  icmp->icmp_code = ee->ee_code;
+  icmp->icmp_void = htonl(ee->ee_info);
+  dgram_iphdr(&icmp->icmp_ip, sizeof(struct ip) + n, (struct in_addr){0},
+              dst->sin_addr, 0);
+  memcpy(&icmp->icmp_ip + 1, data, n);
+
+  ping_process(s, buf, len, &from, NULL, NULL);
+  return 1;
+}
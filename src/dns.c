@@ -0,0 +1,467 @@
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ping.h"
+
+/*
+ * Bulk forward resolution of the targets named by host name.  Lookups run
+ * concurrently on a pool of DNS_WORKERS threads.  With --dns-cache, names
+ * are looked up in the cache file first, and the others are asked to the
+ * name servers directly so that their answers come with a TTL to cache
+ * them for; otherwise getaddrinfo() is used, like for a single host.
+ *
+ * The send loop does not wait for the whole list: dns_start() returns as
+ * soon as one target has its address, and dns_poll() takes the answers in
+ * from the loop as they come, each target going live with its own.  The
+ * workers post the index of every name they are done with to a queue of
+ * their own, which only the loop reads.
+ */
+
+typedef struct dns_ent {
+  char *name;      /* Name asked for */
+  char *canon;     /* Canonical name */
+  in_addr_t addr;  /* Address it resolves to */
+  long long until; /* Expiry, in seconds since the epoch */
+} t_pdnsent;
+
+typedef struct dns_cache {
+  t_pdnsent *ent;
+  size_t len;
+  size_t size;
+} t_pdnscache;
+
+struct dns_job {
+  t_pset *s;
+  size_t *todo;       /* Indices of the targets to resolve */
+  char **canon;       /* Canonical name of every target resolved */
+  in_addr_t *addr;    /* Address of every target resolved */
+  unsigned int *ttl;  /* TTL of every answer, 0 if not to be cached */
+  size_t ntodo;
+  atomic_size_t next; /* Next entry of todo to resolve */
+  int query;          /* Ask the name servers directly */
+  atomic_int stop;    /* Workers are to leave the rest */
+
+  atomic_size_t *done; /* Entries of todo resolved, + 1, in order of posting */
+  atomic_size_t ndone; /* Number of entries posted to done */
+  size_t taken;        /* Number of entries of done taken in */
+  size_t nlive;        /* Targets with an address so far */
+  int efd;             /* Readable once an entry is posted */
+  pthread_t tid[DNS_WORKERS];
+  size_t nthreads;
+
+  t_pdnscache cache;
+  const char *path; /* Cache file, if any */
+  size_t nold;      /* Entries loaded from it */
+  long long now;
+};
+
+static int cache_add(t_pdnscache *c, const char *name, const char *canon,
+                     in_addr_t addr, long long until) {
+  t_pdnsent *e;
+
+  if (c->len == c->size) {
+    size_t size = c->size ? 2 * c->size : 256;
+
+    if (!(e = realloc(c->ent, size * sizeof(*e))))
+      return -1;
+    c->ent = e;
+    c->size = size;
+  }
+  e = &c->ent[c->len];
+  if (!(e->name = strdup(name)) || !(e->canon = strdup(canon))) {
+    free(e->name);
+    return -1;
+  }
+  e->addr = addr;
+  e->until = until;
+  c->len++;
+  return 0;
+}
+
+static void cache_free(t_pdnscache *c) {
+  for (size_t i = 0; i < c->len; i++) {
+    free(c->ent[i].name);
+    free(c->ent[i].canon);
+  }
+  free(c->ent);
+}
+
+static int ent_cmp(const void *a, const void *b) {
+  return strcmp(((const t_pdnsent *)a)->name, ((const t_pdnsent *)b)->name);
+}
+
+/* Entries still valid, sorted by name; a missing file is an empty cache */
+static int cache_load(t_pdnscache *c, const char *path, long long now) {
+  char name[NI_MAXHOST], canon[NI_MAXHOST], addr[INET_ADDRSTRLEN];
+  char line[2 * NI_MAXHOST + 64];
+  struct in_addr in;
+  long long until;
+  FILE *f;
+
+  if (!(f = fopen(path, "r")))
+    return errno == ENOENT ? 0 : -1;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "%1024s %15s %lld %1024s", name, addr, &until, canon) ==
+            4 &&
+        until > now && inet_aton(addr, &in) &&
+        cache_add(c, name, canon, in.s_addr, until)) {
+      fclose(f);
+      return -1;
+    }
+  fclose(f);
+  qsort(c->ent, c->len, sizeof(*c->ent), ent_cmp);
+  return 0;
+}
+
+/* Replace the file as a whole, so that readers never see half of it */
+static int cache_save(t_pdnscache *c, const char *path) {
+  char tmp[PATH_MAX];
+  FILE *f;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (!(f = fopen(tmp, "w")))
+    return -1;
+  for (size_t i = 0; i < c->len; i++)
+    fprintf(f, "%s %s %lld %s\n", c->ent[i].name,
+            inet_ntoa((struct in_addr){c->ent[i].addr}), c->ent[i].until,
+            c->ent[i].canon);
+  if (fclose(f) || rename(tmp, path)) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * A record of name and the smallest TTL along its CNAME chain.  The search
+ * list applies as it would with getaddrinfo().
+ */
+static int dns_query(res_state res, const char *name, in_addr_t *addr,
+                     char *canon, unsigned int *ttl) {
+  unsigned char answer[NS_PACKETSZ * 4];
+  ns_msg msg;
+  ns_rr rr;
+  int len, found = 0;
+
+  *ttl = ~0u;
+  if ((len = res_nsearch(res, name, ns_c_in, ns_t_a, answer,
+                         sizeof(answer))) < 0 ||
+      ns_initparse(answer, MIN(len, (int)sizeof(answer)), &msg))
+    return -1;
+  for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+    if (ns_parserr(&msg, ns_s_an, i, &rr))
+      return -1;
+    *ttl = MIN(*ttl, ns_rr_ttl(rr));
+    if (!found && ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == 4) {
+      memcpy(addr, ns_rr_rdata(rr), 4);
+      snprintf(canon, NI_MAXHOST, "%s", ns_rr_name(rr));
+      found = 1;
+    }
+  }
+  return found ? 0 : -1;
+}
+
+static int dns_lookup(const char *name, in_addr_t *addr, char *canon) {
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_flags = AI_CANONNAME};
+  struct addrinfo *ai;
+
+  if (getaddrinfo(name, NULL, &hints, &ai))
+    return -1;
+  *addr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr;
+  snprintf(canon, NI_MAXHOST, "%s", ai->ai_canonname ? ai->ai_canonname : name);
+  freeaddrinfo(ai);
+  return 0;
+}
+
+/*
+ * Names unknown to the name servers, such as those of the hosts file, are
+ * still resolved through getaddrinfo(), but not cached.  So is every name of
+ * a worker whose resolver could not be set up.
+ */
+static void *dns_main(void *arg) {
+  t_pdnsjob *j = arg;
+  struct __res_state res;
+  char canon[NI_MAXHOST];
+  int query;
+  size_t i;
+
+  memset(&res, 0, sizeof(res));
+  query = j->query && !res_ninit(&res);
+  while (!atomic_load(&j->stop) &&
+         (i = atomic_fetch_add(&j->next, 1)) < j->ntodo) {
+    t_pinfo *p = &j->s->targets[j->todo[i]];
+
+    if (!query ||
+        dns_query(&res, p->hostname, &j->addr[i], canon, &j->ttl[i])) {
+      j->ttl[i] = 0;
+      if (dns_lookup(p->hostname, &j->addr[i], canon))
+        canon[0] = 0;
+    }
+    if (canon[0])
+      j->canon[i] = strdup(canon);
+    atomic_store(&j->done[atomic_fetch_add(&j->ndone, 1)], i + 1);
+    if (j->efd >= 0)
+      eventfd_write(j->efd, 1);
+  }
+  if (query)
+    res_nclose(&res);
+  return NULL;
+}
+
+/* Workers are spared the signals, which are for the caller */
+static void dns_spawn(t_pdnsjob *j) {
+  size_t n = MIN(j->ntodo - j->next, DNS_WORKERS);
+  sigset_t all, old;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  while (j->nthreads < n &&
+         !pthread_create(&j->tid[j->nthreads], NULL, dns_main, j))
+    j->nthreads++;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (!j->nthreads && n)
+    dns_main(j);
+}
+
+static void dns_join(t_pdnsjob *j) {
+  while (j->nthreads)
+    pthread_join(j->tid[--j->nthreads], NULL);
+}
+
+/* Drop the targets that could not be resolved, keeping the others in order */
+static void dns_compact(t_pset *s) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[i];
+
+    if (p->state != TARGET_LIVE || !p->hostname) {
+      error(0, 0, "unknown host %s", p->hostname ? p->hostname : "?");
+      free(p->hostname);
+      continue;
+    }
+    s->targets[n++] = *p;
+  }
+  s->ntargets = n;
+}
+
+static void dns_job_free(t_pdnsjob *j) {
+  if (!j)
+    return;
+  atomic_store(&j->stop, 1);
+  dns_join(j);
+  if (j->path && j->cache.len > j->nold && cache_save(&j->cache, j->path))
+    error(0, errno, "%s", j->path);
+  for (size_t i = 0; i < j->ntodo; i++)
+    free(j->canon[i]);
+  if (j->efd >= 0)
+    close(j->efd);
+  free(j->todo);
+  free(j->canon);
+  free(j->addr);
+  free(j->ttl);
+  free(j->done);
+  cache_free(&j->cache);
+  free(j);
+}
+
+/*
+ * The names to resolve, or NULL if there is none.  Those found in the cache
+ * come first, and are posted as answered already.
+ */
+static int dns_job(t_pset *s, t_pdnsjob **jp) {
+  const char *path = s->opt.dns_cache;
+  t_pdnsjob *j;
+  size_t n = 0;
+
+  *jp = NULL;
+  for (size_t i = 0; i < s->ntargets; i++)
+    n += s->targets[i].state == TARGET_PENDING;
+  if (!n)
+    return 0;
+  if (!(j = calloc(1, sizeof(*j))))
+    return -1;
+  j->s = s;
+  j->efd = -1;
+  j->query = path != NULL;
+  j->path = path;
+  j->now = time(NULL);
+  if (!(j->todo = malloc(n * sizeof(*j->todo))) ||
+      !(j->canon = calloc(n, sizeof(*j->canon))) ||
+      !(j->addr = calloc(n, sizeof(*j->addr))) ||
+      !(j->ttl = calloc(n, sizeof(*j->ttl))) ||
+      !(j->done = calloc(n, sizeof(*j->done)))) {
+    dns_job_free(j);
+    return -1;
+  }
+  if (path && cache_load(&j->cache, path, j->now))
+    error(0, errno, "%s", path);
+  j->nold = j->cache.len;
+  /* Misses are filled in from the end, then put back in order */
+  for (size_t i = 0, back = n; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[i];
+    t_pdnsent key = {.name = p->hostname}, *e;
+
+    if (p->state != TARGET_PENDING)
+      continue;
+    if (!j->nold ||
+        !(e = bsearch(&key, j->cache.ent, j->nold, sizeof(*e), ent_cmp))) {
+      j->todo[--back] = i;
+      continue;
+    }
+    j->addr[j->ntodo] = e->addr;
+    j->canon[j->ntodo] = strdup(e->canon);
+    atomic_store(&j->done[j->ntodo], j->ntodo + 1);
+    j->todo[j->ntodo++] = i;
+  }
+  for (size_t a = j->ntodo, b = n - 1; a < b; a++, b--) {
+    size_t t = j->todo[a];
+
+    j->todo[a] = j->todo[b];
+    j->todo[b] = t;
+  }
+  atomic_store(&j->next, j->ntodo);
+  atomic_store(&j->ndone, j->ntodo);
+  j->ntodo = n;
+  *jp = j;
+  return 0;
+}
+
+/* Answer i, given to its target; 0 if the name could not be resolved */
+static int dns_apply(t_pdnsjob *j, size_t i) {
+  t_pinfo *p = &j->s->targets[j->todo[i]];
+
+  if (!j->canon[i])
+    return 0;
+  if (j->path && j->ttl[i])
+    cache_add(&j->cache, p->hostname, j->canon[i], j->addr[i],
+              j->now + j->ttl[i]);
+  p->dst.sin_family = AF_INET;
+  p->dst.sin_addr.s_addr = j->addr[i];
+  free(p->hostname);
+  p->hostname = j->canon[i];
+  j->canon[i] = NULL;
+  return 1;
+}
+
+/* Every name at once, for the sessions whose targets are all set up front */
+int dns_resolve(t_pset *s) {
+  t_pdnsjob *j;
+
+  if (dns_job(s, &j)) {
+    perror("dns_resolve failed");
+    return -1;
+  }
+  if (j) {
+    dns_spawn(j);
+    dns_join(j);
+    for (size_t i = 0; i < j->ntodo; i++)
+      if (dns_apply(j, i))
+        s->targets[j->todo[i]].state = TARGET_LIVE;
+    dns_job_free(j);
+  }
+  dns_compact(s);
+  return 0;
+}
+
+/*
+ * Answers posted so far, each target going live with its own.  Once the
+ * run has started, new targets get their header and preload right away.
+ */
+static int dns_take(t_pset *s, int started) {
+  t_pdnsjob *j = s->dns;
+  size_t i, nlive;
+
+  while (j->taken < j->ntodo && (i = atomic_load(&j->done[j->taken]))) {
+    t_pinfo *p = &s->targets[j->todo[--i]];
+
+    j->taken++;
+    if (!dns_apply(j, i)) {
+      error(0, 0, "unknown host %s", p->hostname);
+      p->state = TARGET_DEAD;
+    } else if (!target_activate(s, p)) {
+      j->nlive++;
+      if (started) {
+        ping_header(s, p);
+        for (uint k = 0; k < s->opt.preload; k++)
+          send_echo(s, p, 0);
+      }
+      continue;
+    }
+    /* Done with as far as a count is concerned */
+    if (s->opt.count)
+      atomic_fetch_add(&s->ndone, 1);
+  }
+  if (j->taken < j->ntodo)
+    return 0;
+  nlive = j->nlive;
+  dns_free(s);
+  if (!nlive) {
+    fprintf(stderr, "ft_ping: no destinations to ping\n");
+    return -1;
+  }
+  /* The socket filter can now check the destinations */
+  return filter_attach(s);
+}
+
+/*
+ * Start resolving the names of the targets, in the background, and return
+ * once the first of them can be pinged.  The hash of the targets is ready.
+ */
+int dns_start(t_pset *s) {
+  t_pdnsjob *j;
+  eventfd_t v;
+
+  if (dns_job(s, &j)) {
+    perror("dns_start failed");
+    return -1;
+  }
+  if (!j)
+    return 0;
+  for (size_t i = 0; i < s->ntargets; i++)
+    if (s->targets[i].state == TARGET_LIVE)
+      j->nlive++;
+  if ((j->efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    perror("dns_start failed");
+    dns_job_free(j);
+    return -1;
+  }
+  s->dns = j;
+  dns_spawn(j);
+  while (!dns_take(s, 0)) {
+    if (!s->dns || j->nlive || atomic_load(&s->stop))
+      return 0;
+    if (eventfd_read(j->efd, &v) && errno != EINTR) {
+      perror("dns_start failed");
+      return -1;
+    }
+  }
+  return -1;
+}
+
+int dns_poll(t_pset *s) { return s->dns ? dns_take(s, 1) : 0; }
+
+/* Lookups under way are waited for, the others left */
+void dns_free(t_pset *s) {
+  t_pdnsjob *j = s->dns;
+
+  s->dns = NULL;
+  dns_job_free(j);
+}
@@ -18,22 +18,26 @@
 #include "icmp.h"
 #include "ping.h"
 
-int send_echo(t_pinfo *p) {
-
-  icmphdr_t *icmp;
-  struct timeval tv;
-  size_t off = 0;
-
-  icmp = (icmphdr_t *)p->buffer;
-  gettimeofday(&tv, NULL);
-  if (TIMING(p->data_size)) {
-    memcpy(icmp->icmp_data, &tv, sizeof(tv));
-    off += sizeof(tv);
-  }
-  if (opt_vals.data)
-    memcpy(icmp->icmp_data + off, opt_vals.data,
-           off ? p->data_size - off : p->data_size);
-  return ping_xmit(p);
+/*
+ * due is the time an open loop schedule wanted the probe out, or 0.  How
+ * late it goes is read from the clock as it is stamped, not from the time
+ * the send loop woke up at, which earlier sends of the same turn delay.
+ */
+int send_echo(t_pset *s, t_pinfo *p, long long due) {
+  unsigned char *pkt = pool_slot(s);
+  t_pevent ev;
+
+  ev.type = EV_SEND;
+  ev.p = p;
+  ev.seq = p->num_sent++;
+  s->tp->wallclock(s, &ev.tv);
+  ev.lag = due ? MAX(s->tp->clock(s) - due, 0) : 0;
+  icmp_echo_patch(pkt, ev.seq, &ev.tv,
+                  TIMING(s->data_size) ? sizeof(ev.tv) : 0);
+
+  /* Accounted first, so that the reply cannot overtake it */
+  ping_event(s, &ev);
+  return s->tx.size ? batch_queue(s, p, pkt) : ping_xmit(s, p, pkt);
 }
 
 /*
@@ -49,14 +53,23 @@ static void tvsub(struct timeval *out, struct timeval *in) {
   out->tv_sec -= in->tv_sec;
 }
 
-void print_echo(int dupflag, struct sockaddr_in *from, struct ip *ip,
-                icmphdr_t *icmp, unsigned int datalen) {
+/*
+ * now is the time the reply was received in userspace.  ktrip is the round
+ * trip time measured from kernel timestamps, or negative if there are none.
+ * When present it replaces the userspace measurement, and the difference
+ * between the two is accounted as userspace overhead.  lag is how late the
+ * probe was sent on an open loop schedule in ms, or negative: adding it gives
+ * the round trip from the intended send time, which a stalled sender cannot
+ * hide.
+ */
+void print_echo(t_pset *s, t_pinfo *p, int seqclass, struct sockaddr_in *from,
+                struct ip *ip, icmphdr_t *icmp, unsigned int datalen,
+                const struct timeval *now, double ktrip, double lag) {
   unsigned int hlen;
-  struct timeval tv;
+  struct timeval tv = *now;
   int timing = 0;
   double triptime = 0.0;
-
-  gettimeofday(&tv, NULL);
+  double overhead = -1;
 
   /* Length of IP header */
   hlen = ip->ip_hl << 2;
@@ -76,59 +89,84 @@ void print_echo(int dupflag, struct sockaddr_in *from, struct ip *ip,
     tvsub(&tv, &tv1);
 
     triptime = ((double)tv.tv_sec) * 1000.0 + ((double)tv.tv_usec) / 1000.0;
-    stat.tsum += triptime;
-    stat.tsumsq += triptime * triptime;
-    if (triptime < stat.tmin)
-      stat.tmin = triptime;
-    if (triptime > stat.tmax)
-      stat.tmax = triptime;
+    if (ktrip >= 0) {
+      overhead = MAX(triptime - ktrip, 0.0);
+      triptime = ktrip;
+      p->stat.osum += overhead;
+      p->stat.omax = MAX(p->stat.omax, overhead);
+      p->stat.nkern++;
+    }
+    stat_add(&p->stat, triptime);
+    if (p->istat)
+      stat_add(p->istat, triptime);
+    if (lag >= 0 && p->ostat)
+      stat_add(p->ostat, triptime + lag);
   }
 
-  if (opts & OPT_QUIET)
+  if (s->cb.reply) {
+    t_ftreply r = {.host = p->hostname,
+                   .addr = p->dst.sin_addr,
+                   .seq = icmp->icmp_seq,
+                   .ttl = ip->ip_ttl,
+                   .bytes = datalen,
+                   .rtt = timing ? triptime : -1,
+                   .irtt = timing && lag >= 0 ? triptime + lag : -1,
+                   .status = seqclass};
+
+    s->cb.reply(s, &r, s->cb.arg);
+  }
+  if (s->opts & OPT_QUIET)
     return;
-  if (opts & OPT_FLOOD) {
-    putchar('\b');
+  if (s->opt.format) {
+    report_reply(s, p, ip, icmp, datalen, seqclass, timing ? triptime : -1,
+                 timing && lag >= 0 ? triptime + lag : -1);
+    return;
+  }
+  if (s->opts & OPT_FLOOD) {
+    ob_putc(&s->out, '\b');
     return;
   }
 
-  printf("%d bytes from %s: icmp_seq=%u", datalen,
-         inet_ntoa(*(struct in_addr *)&from->sin_addr.s_addr), icmp->icmp_seq);
-  printf(" ttl=%d", ip->ip_ttl);
-  if (timing)
-    printf(" time=%.3f ms", triptime);
-  if (dupflag)
-    printf(" (DUP!)");
-
-  printf("\n");
+  ob_reserve(&s->out, OBUF_RECORD);
+  ob_putu(&s->out, datalen);
+  ob_puts(&s->out, " bytes from ");
+  ob_putip(&s->out, from->sin_addr);
+  ob_puts(&s->out, ": icmp_seq=");
+  ob_putu(&s->out, icmp->icmp_seq);
+  ob_puts(&s->out, " ttl=");
+  ob_putu(&s->out, ip->ip_ttl);
+  if (timing) {
+    ob_puts(&s->out, " time=");
+    ob_putfix(&s->out, triptime, 3);
+    ob_puts(&s->out, " ms");
+  }
+  if (timing && lag >= 0) {
+    ob_puts(&s->out, " intended=");
+    ob_putfix(&s->out, triptime + lag, 3);
+    ob_puts(&s->out, " ms");
+  }
+  if (overhead >= 0) {
+    ob_puts(&s->out, " overhead=");
+    ob_putfix(&s->out, overhead, 3);
+    ob_puts(&s->out, " ms");
+  }
+  if (seqclass == SEQ_DUP)
+    ob_puts(&s->out, " (DUP!)");
+  else if (seqclass == SEQ_LATE)
+    ob_puts(&s->out, " (LATE!)");
+  ob_putc(&s->out, '\n');
 }
 
-static char *ipaddr2str(struct in_addr ina) {
-  struct hostent *hp;
-
-  if (opts & OPT_NUMERIC || !(hp = gethostbyaddr((char *)&ina, 4, AF_INET))) {
-    char *s = strdup(inet_ntoa(ina));
-    if (!s)
-      goto err;
-    return s;
-  } else {
-    char *ipstr = inet_ntoa(ina);
-    int len = strlen(hp->h_name) + 1;
-
-    if (ipstr)
-      len += strlen(ipstr) + 3; /* a pair of parentheses and a space */
-
-    char *buf = malloc(len);
-    if (!buf)
-      goto err;
-    if (ipstr)
-      snprintf(buf, len, "%s (%s)", hp->h_name, ipstr);
-    else
-      snprintf(buf, len, "%s", hp->h_name);
-    return buf;
-  }
-err:
-  perror("ipaddr2str conversion");
-  return NULL;
+/* Probe whose deadline passed without a reply */
+void print_timeout(t_pset *s, t_pinfo *p, t_pseqent *ent) {
+  ob_reserve(&s->out, OBUF_RECORD);
+  ob_puts(&s->out, "request timeout for ");
+  ob_putip(&s->out, p->dst.sin_addr);
+  ob_puts(&s->out, ": icmp_seq=");
+  ob_putu(&s->out, ent->seq & 0xffff);
+  ob_puts(&s->out, " rto=");
+  ob_putfix(&s->out, ent->rto / 1000000.0, 3);
+  ob_puts(&s->out, " ms\n");
 }
 
 #define NITEMS(a) sizeof(a) / sizeof((a)[0])
@@ -136,7 +174,7 @@ err:
 struct icmp_diag {
   int type;
   char *text;
-  void (*fun)(icmphdr_t *, void *data);
+  void (*fun)(t_pset *, icmphdr_t *, void *data);
   void *data;
 };
 
@@ -168,67 +206,76 @@ struct icmp_code_descr {
     {ICMP_TIME_EXCEEDED, ICMP_EXC_TTL, "Time to live exceeded"},
     {ICMP_TIME_EXCEEDED, ICMP_EXC_FRAGTIME, "Frag reassembly time exceeded"}};
 
-static void print_icmp_code(int type, int code, char *prefix) {
+static void print_icmp_code(t_obuf *ob, int type, int code, char *prefix) {
   struct icmp_code_descr *p;
 
   for (p = icmp_code_descr; p < icmp_code_descr + NITEMS(icmp_code_descr); p++)
     if (p->type == type && p->code == code) {
-      printf("%s\n", p->diag);
+      ob_printf(ob, "%s\n", p->diag);
       return;
     }
 
-  printf("%s, Unknown Code: %d\n", prefix, code);
+  ob_printf(ob, "%s, Unknown Code: %d\n", prefix, code);
 }
 
-static void print_ip_header(struct ip *ip) {
+static void print_ip_header(t_obuf *ob, struct ip *ip) {
   int hlen;
   unsigned char *cp;
 
   hlen = ip->ip_hl << 2;
   cp = (unsigned char *)ip + 20; /* point to options */
 
-  printf("Vr HL TOS  Len   ID Flg  off TTL Pro  cks      Src      Dst Data\n");
-  printf(" %1x  %1x  %02x %04x %04x", ip->ip_v, ip->ip_hl, ip->ip_tos,
-         ip->ip_len, ip->ip_id);
-  printf("   %1x %04x", ((ip->ip_off) & 0xe000) >> 13, (ip->ip_off) & 0x1fff);
-  printf("  %02x  %02x %04x", ip->ip_ttl, ip->ip_p, ip->ip_sum);
-  printf(" %s ", inet_ntoa(*((struct in_addr *)&ip->ip_src)));
-  printf(" %s ", inet_ntoa(*((struct in_addr *)&ip->ip_dst)));
+  ob_printf(ob,
+            "Vr HL TOS  Len   ID Flg  off TTL Pro  cks      Src      Dst Data\n");
+  ob_printf(ob, " %1x  %1x  %02x %04x %04x", ip->ip_v, ip->ip_hl, ip->ip_tos,
+            ip->ip_len, ip->ip_id);
+  ob_printf(ob, "   %1x %04x", ((ip->ip_off) & 0xe000) >> 13,
+            (ip->ip_off) & 0x1fff);
+  ob_printf(ob, "  %02x  %02x %04x", ip->ip_ttl, ip->ip_p, ip->ip_sum);
+  ob_putc(ob, ' ');
+  ob_putip(ob, ip->ip_src);
+  ob_puts(ob, "  ");
+  ob_putip(ob, ip->ip_dst);
+  ob_putc(ob, ' ');
   while (hlen-- > 20)
-    printf("%02x", *cp++);
+    ob_printf(ob, "%02x", *cp++);
 
-  printf("\n");
+  ob_putc(ob, '\n');
 }
 
-void print_ip_data(icmphdr_t *icmp, void *data __attribute__((unused))) {
+static void print_ip_data(t_pset *s, icmphdr_t *icmp,
+                          void *data __attribute__((unused))) {
+  t_obuf *ob = &s->out;
   int hlen;
   unsigned char *cp;
   struct ip *ip = &icmp->icmp_ip;
 
-  if (!(opts & OPT_VERBOSE))
+  if (!(s->opts & OPT_VERBOSE))
     return;
 
-  print_ip_header(ip);
+  print_ip_header(ob, ip);
 
   hlen = ip->ip_hl << 2;
   cp = (unsigned char *)ip + hlen;
 
   if (ip->ip_p == 6)
-    printf("TCP: from port %u, to port %u (decimal)\n", (*cp * 256 + *(cp + 1)),
-           (*(cp + 2) * 256 + *(cp + 3)));
+    ob_printf(ob, "TCP: from port %u, to port %u (decimal)\n",
+              (*cp * 256 + *(cp + 1)), (*(cp + 2) * 256 + *(cp + 3)));
   else if (ip->ip_p == 17)
-    printf("UDP: from port %u, to port %u (decimal)\n", (*cp * 256 + *(cp + 1)),
-           (*(cp + 2) * 256 + *(cp + 3)));
+    ob_printf(ob, "UDP: from port %u, to port %u (decimal)\n",
+              (*cp * 256 + *(cp + 1)), (*(cp + 2) * 256 + *(cp + 3)));
 }
 
-static void print_icmp(icmphdr_t *icmp, void *data) {
-  print_icmp_code(icmp->icmp_type, icmp->icmp_code, data);
-  print_ip_data(icmp, NULL);
+static void print_icmp(t_pset *s, icmphdr_t *icmp, void *data) {
+  print_icmp_code(&s->out, icmp->icmp_type, icmp->icmp_code, data);
+  print_ip_data(s, icmp, NULL);
 }
 
-static void print_parameterprob(icmphdr_t *icmp, void *data) {
-  printf("Parameter problem: IP address = %s\n", inet_ntoa(icmp->icmp_gwaddr));
-  print_ip_data(icmp, data);
+static void print_parameterprob(t_pset *s, icmphdr_t *icmp, void *data) {
+  ob_puts(&s->out, "Parameter problem: IP address = ");
+  ob_putip(&s->out, icmp->icmp_gwaddr);
+  ob_putc(&s->out, '\n');
+  print_ip_data(s, icmp, data);
 }
 
 struct icmp_diag icmp_diag[] = {
@@ -244,26 +291,26 @@ struct icmp_diag icmp_diag[] = {
     {ICMP_INFO_REQUEST, "Information Request", NULL, NULL},
 };
 
-void print_icmp_header(struct sockaddr_in *from, struct ip *ip, icmphdr_t *icmp,
-                       unsigned int datalen) {
+void print_icmp_header(t_pset *s, struct sockaddr_in *from, struct ip *ip,
+                       icmphdr_t *icmp, unsigned int datalen) {
+  char name[NI_MAXHOST + INET_ADDRSTRLEN + 3];
   unsigned int hlen;
-  char *s;
   struct icmp_diag *p;
 
   /* Length of the IP header */
   hlen = ip->ip_hl << 2;
 
-  printf("%d bytes from %s: ", datalen - hlen, s = ipaddr2str(from->sin_addr));
-  free(s);
+  ob_printf(&s->out, "%d bytes from %s: ", datalen - hlen,
+            resolv_name(s, from->sin_addr, name, sizeof(name)));
 
   for (p = icmp_diag; p < icmp_diag + NITEMS(icmp_diag); p++) {
     if (p->type == icmp->icmp_type) {
       if (p->text)
-        printf("%s\n", p->text);
+        ob_printf(&s->out, "%s\n", p->text);
       if (p->fun)
-        p->fun(icmp, p->data);
+        p->fun(s, icmp, p->data);
       return;
     }
   }
-  printf("Bad ICMP type: %d\n", icmp->icmp_type);
+  ob_printf(&s->out, "Bad ICMP type: %d\n", icmp->icmp_type);
 }
@@ -1,9 +1,12 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <sys/param.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <memory.h>
 #include <poll.h>
 #include <printf.h>
@@ -13,66 +16,140 @@
 
 #include "ping.h"
 
-t_pstat stat;
-int volatile stop = 0;
+/*
+ * Next target in round-robin order that still has packets to send, whether
+ * its name has resolved yet or not.
+ */
+static t_pinfo *next_target(t_pset *s, size_t *cursor) {
+  for (size_t i = 0; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[*cursor];
 
-void sig_int(int signal __attribute__((unused))) { stop = 1; }
-
-static int detect_timeout(const struct timespec *start, uint timeout) {
-  struct timespec now;
-
-  if (timeout > 0) {
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    time_t elapsed = now.tv_sec - start->tv_sec;
-
-    if (now.tv_nsec - start->tv_nsec)
-      elapsed--;
-    if (elapsed >= timeout)
-      return 1;
+    if (++*cursor >= s->ntargets)
+      *cursor = 0;
+    if (p->state != TARGET_DEAD &&
+        (!s->opt.count || p->num_sent < s->opt.count))
+      return p;
   }
-  return 0;
+  return NULL;
 }
 
-static int run(t_pinfo *p) {
-  struct pollfd pfd = {.fd = p->fd, .events = POLLIN};
-  int intvl = opts & OPT_FLOOD ? 10 : opt_vals.interval;
-  size_t cnt = 0;
-  int stopping = 0;
+/* Preload, then start the send schedule now */
+static void run_init(t_pset *s) {
+  t_prun *r = &s->run;
+  long long now;
 
-  for (uint i = 0; i < opt_vals.preload; i++)
-    send_echo(p);
+  memset(r, 0, sizeof(*r));
+  r->intvl = s->pace.num * (long long)s->ntargets / s->pace.den;
+  if (!(s->opts & OPT_THREADS))
+    r->report = s->opt.report_intvl * 1000000000LL;
+  if (s->opt.timeout)
+    r->deadline = s->start_time.tv_sec * 1000000000LL +
+                  s->start_time.tv_nsec + s->opt.timeout * 1000000000LL;
 
-  send_echo(p);
-  while (!stop) {
-    int rc = poll(&pfd, 1, intvl);
+  for (size_t i = 0; i < s->ntargets; i++)
+    for (uint j = 0; s->targets[i].state == TARGET_LIVE && j < s->opt.preload;
+         j++)
+      send_echo(s, &s->targets[i], 0);
+  if (s->tx.len)
+    batch_flush(s);
 
-    if (rc < 0) {
-      if (errno != EINTR)
-        perror("poll failed");
-      continue;
-    } else if (rc == 0) {
-      if (!opt_vals.count || p->num_xmit < opt_vals.count) {
-        send_echo(p);
-        if (!(opts & OPT_QUIET) && opts & OPT_FLOOD)
-          putchar('.');
-        fflush(stdout);
-        if (detect_timeout(&p->start_time, opt_vals.timeout))
-          break;
-      } else if (stopping) {
+  now = s->tp->clock(s);
+  s->pace.start = now;
+  if (r->report)
+    r->next_report = now + r->report;
+}
+
+/*
+ * One turn of the send loop: send what is due, then wait for replies until
+ * the next send slot.  Every target is pinged once per interval, or the
+ * whole set at the given rate; sends to different targets are spread
+ * evenly over the interval so that a large set does not go out as a single
+ * burst.  The clock is read once per turn, and once per send on an open
+ * loop schedule to time how late it goes.  In threaded mode this runs in
+ * the transmit thread: the socket is left to the receive thread and the
+ * output to the consumer.  Returns 1 once the run is over.
+ */
+int ping_step(t_pset *s) {
+  t_prun *r = &s->run;
+  int rto = s->wheel && !(s->opts & OPT_THREADS);
+  long long now, wake;
+  t_pinfo *p;
+  size_t n;
+  int rc;
+
+  if (atomic_load(&s->stop))
+    return 1;
+  if (dns_poll(s))
+    return -1;
+  now = s->tp->clock(s);
+  if (r->deadline && now >= r->deadline)
+    return 1;
+  /* In threaded mode the deadlines belong to the accounting side */
+  if (rto) {
+    rto_run(s, now);
+    if (r->stopping && !s->wheel->len)
+      return 1;
+  }
+  if (r->report && now >= r->next_report) {
+    report_interval(s);
+    r->next_report += r->report;
+  }
+  if (!r->stopping) {
+    for (n = pace_due(&s->pace, now); n; n--) {
+      if (!(p = next_target(s, &r->cursor))) {
+        r->stopping = 1;
+        r->next = now + r->intvl;
         break;
-      } else {
-        stopping = 1;
-        intvl = opt_vals.linger;
       }
-    } else if (pfd.revents & POLLIN) {
-      if (ping_recv(p) == 0)
-        cnt++;
-      if (detect_timeout(&p->start_time, opt_vals.timeout) ||
-          (opt_vals.count && (cnt >= opt_vals.count)))
-        break;
+      /* Targets still waiting for their name give their slots up */
+      if (p->state == TARGET_PENDING) {
+        pace_pass(&s->pace);
+        continue;
+      }
+      send_echo(s, p, s->pace.sched ? pace_time(&s->pace, s->pace.slot) : 0);
+      pace_sent(&s->pace, now);
     }
+    if (!r->stopping)
+      r->next = pace_time(&s->pace, s->pace.slot);
+  } else if (rto) {
+    /* Over once every probe has its reply or has timed out, not lingering */
+    r->next = LLONG_MAX;
+  } else if (s->wheel) {
+    /* The accounting thread waits for the timeouts, the sender is done */
+    return 1;
+  } else if (now >= r->next) {
+    if (r->stopping > 1)
+      return 1;
+    /* Last interval has passed, linger for late replies */
+    r->stopping++;
+    r->next = now + s->opt.linger * 1000000LL;
   }
-  return 0;
+
+  if (s->tx.len)
+    batch_flush(s);
+  if (!(s->opts & OPT_THREADS) && s->out.len)
+    ob_flush(&s->out);
+
+  wake = r->deadline ? MIN(r->next, r->deadline) : r->next;
+  if (r->report)
+    wake = MIN(wake, r->next_report);
+  if (rto && s->wheel->len)
+    wake = MIN(wake, rto_next(s));
+  /* Behind an open loop schedule, replies are still read between sends */
+  if (wake <= now && !s->pace.sched)
+    return 0;
+  if ((rc = s->tp->wait(s, &s->pace, wake)) < 0)
+    return -1;
+  return rc || (s->opt.count && atomic_load(&s->ndone) >= s->ntargets);
+}
+
+static int run(t_pset *s, t_pacer *pace __attribute__((unused))) {
+  int rc;
+
+  run_init(s);
+  while (!(rc = ping_step(s)))
+    ;
+  return rc < 0 ? -1 : 0;
 }
 
 static double nabs(double a) { return (a < 0) ? -a : a; }
@@ -93,48 +170,215 @@ static double nsqrt(double a, double prec) {
   return x1;
 }
 
-static void print_stat(t_pinfo *p) {
-  fflush(stdout);
-  printf("--- %s ping statistics ---\n", p->hostname);
-  printf("%zu packets transmitted, ", p->num_xmit);
-  printf("%zu packets received, ", p->num_recv);
+static void print_stat(t_pset *s, t_pinfo *p) {
+  t_obuf *ob = &s->out;
+
+  ob_printf(ob, "--- %s ping statistics ---\n", p->hostname);
+  ob_printf(ob, "%zu packets transmitted, ", p->num_xmit);
+  ob_printf(ob, "%zu packets received, ", p->num_recv);
   if (p->num_rept)
-    printf("+%zu duplicates, ", p->num_rept);
+    ob_printf(ob, "+%zu duplicates, ", p->num_rept);
   if (p->num_xmit) {
     if (p->num_recv > p->num_xmit)
-      printf("-- somebody is printing forged packets!");
+      ob_puts(ob, "-- somebody is printing forged packets!");
+    else
+      ob_printf(ob, "%d%% packet loss",
+                (int)(((p->num_xmit - p->num_recv) * 100) / p->num_xmit));
+  }
+  ob_putc(ob, '\n');
+  /*
+   * Received counts the replies in time only: a late one answers a probe
+   * already counted as lost, and stays lost.  Its round trip still counts.
+   */
+  if (p->win.late || p->win.reord || s->opt.rto_min)
+    ob_printf(ob, "%zu lost, %zu late, %zu reordered\n", p->win.lost,
+              p->win.late, p->win.reord);
+  if (p->stat.hist.count && TIMING(s->data_size)) {
+    double total = p->stat.hist.count;
+    double avg = p->stat.tsum / total;
+    double vari = p->stat.tsumsq / total - avg * avg;
+
+    ob_printf(ob, "round-trip min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f ms\n",
+              p->stat.tmin, avg, p->stat.tmax, nsqrt(vari, 0.0005));
+    ob_printf(ob, "round-trip p50/p90/p99/p99.9 = %.3f/%.3f/%.3f/%.3f ms\n",
+              stat_percentile(&p->stat, 50), stat_percentile(&p->stat, 90),
+              stat_percentile(&p->stat, 99), stat_percentile(&p->stat, 99.9));
+    if (p->stat.nkern)
+      ob_printf(ob,
+                "userspace overhead avg/max = %.3f/%.3f ms "
+                "(%zu kernel timed samples)\n",
+                p->stat.osum / p->stat.nkern, p->stat.omax, p->stat.nkern);
+  }
+  if (p->srtt)
+    ob_printf(ob, "srtt/rttvar/rto = %.3f/%.3f/%.3f ms\n", p->srtt / 1e6,
+              p->rttvar / 1e6, p->rto / 1e6);
+  if (p->ostat && p->ostat->hist.count)
+    ob_printf(ob,
+              "intended round-trip p50/p90/p99/p99.9 = %.3f/%.3f/%.3f/%.3f "
+              "ms\n",
+              stat_percentile(p->ostat, 50), stat_percentile(p->ostat, 90),
+              stat_percentile(p->ostat, 99), stat_percentile(p->ostat, 99.9));
+  if (p->lag && p->lag->hist.count)
+    ob_printf(ob, "send lag avg/p99/max = %.3f/%.3f/%.3f ms\n",
+              p->lag->tsum / p->lag->hist.count, stat_percentile(p->lag, 99),
+              p->lag->tmax);
+}
+
+/* Summary of all destinations, merged from the per-target statistics */
+static void print_total(t_pset *s, size_t n) {
+  t_pstat ostat, lag;
+  char name[64];
+  t_pinfo all;
+
+  memset(&all, 0, sizeof(all));
+  memset(&ostat, 0, sizeof(ostat));
+  memset(&lag, 0, sizeof(lag));
+  if (s->opt.open_loop) {
+    all.ostat = &ostat;
+    all.lag = &lag;
+  }
+  if (stat_init(&all.stat) ||
+      (s->opt.open_loop && (stat_init(&ostat) || stat_init(&lag)))) {
+    perror("print_total failed");
+    goto out;
+  }
+  snprintf(name, sizeof(name), "%zu destinations", n);
+  all.hostname = name;
+  for (size_t i = 0; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[i];
+
+    all.num_xmit += p->num_xmit;
+    all.num_recv += p->num_recv;
+    all.num_rept += p->num_rept;
+    all.win.lost += p->win.lost;
+    all.win.late += p->win.late;
+    all.win.reord += p->win.reord;
+    stat_merge(&all.stat, &p->stat);
+    if (p->ostat)
+      stat_merge(all.ostat, p->ostat);
+    if (p->lag)
+      stat_merge(all.lag, p->lag);
+  }
+  print_stat(s, &all);
+out:
+  stat_free(&all.stat);
+  stat_free(&ostat);
+  stat_free(&lag);
+}
+
+/* Final statistics of every target, and of all of them together */
+void print_summary(t_pset *s) {
+  size_t n = 0;
+
+  /* Of the targets which could be pinged */
+  for (size_t i = 0; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[i];
+
+    if (p->state != TARGET_LIVE)
+      continue;
+    if (s->opt.format)
+      report_summary(s, p);
     else
-      printf("%d%% packet loss",
-             (int)(((p->num_xmit - p->num_recv) * 100) / p->num_xmit));
+      print_stat(s, p);
+    n++;
   }
-  printf("\n");
-  if (p->num_recv && TIMING(p->data_size)) {
-    double total = p->num_recv + p->num_rept;
-    double avg = stat.tsum / total;
-    double vari = stat.tsumsq / total - avg * avg;
-
-    printf("round-trip min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f ms\n",
-           stat.tmin, avg, stat.tmax, nsqrt(vari, 0.0005));
+  if (!s->opt.format && n > 1)
+    print_total(s, n);
+}
+
+static void print_pacing(t_obuf *ob, t_pacer *t) {
+  ob_printf(ob, "--- pacing ---\n");
+  ob_printf(ob, "%.1f pps requested, %.1f pps achieved", pace_requested(t),
+            pace_achieved(t));
+  if (t->skipped)
+    ob_printf(ob, ", %zu slots skipped", t->skipped);
+  ob_putc(ob, '\n');
+}
+
+/* Header of a target, printed once it can be pinged */
+void ping_header(t_pset *s, t_pinfo *p) {
+  if (s->opt.format)
+    return;
+  ob_printf(&s->out, "PING %s (%s): %zu data bytes", p->hostname,
+            inet_ntoa(p->dst.sin_addr), s->data_size);
+  if (s->opts & OPT_VERBOSE)
+    ob_printf(&s->out, ", id 0x%04x = %u", s->id, s->id);
+  ob_putc(&s->out, '\n');
+}
+
+/* Set up the schedule and print the headers */
+int ping_start(t_pset *s) {
+  int rc;
+
+  if (s->opt.rate && s->share)
+    /* rate * ntargets / share packets per second, fractions included */
+    rc = pace_init(&s->pace, 1000000000LL * s->share,
+                   (long long)s->opt.rate * s->ntargets);
+  else if (s->opt.rate)
+    rc = pace_init(&s->pace, 1000000000LL, s->opt.rate);
+  else
+    rc = pace_init(&s->pace, s->opt.interval, s->ntargets);
+  if (rc)
+    return rc;
+  if (s->opt.open_loop) {
+    uint64_t seed = s->opt.seed;
+
+    /* Every run draws its own Poisson schedule, unless given a seed */
+    if (!seed && getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+      seed = s->tp->clock(s);
+    pace_open(&s->pace, s->opt.open_loop, s->opt.burst, seed);
   }
-  fflush(stdout);
+
+  for (size_t i = 0; i < s->ntargets; i++) {
+    if (stat_init(&s->targets[i].stat)) {
+      perror("ping_start failed");
+      return -1;
+    }
+    if (s->targets[i].state == TARGET_LIVE)
+      ping_header(s, &s->targets[i]);
+  }
+  if (s->out.len)
+    ob_flush(&s->out);
+  if (!(s->opts & OPT_THREADS))
+    run_init(s);
+  return 0;
 }
 
-int exec(t_pinfo *p) {
-  int rc = 0;
+/* Lag of the probes whose entries were never taken over */
+static void lag_finish(t_pinfo *p) {
+  for (size_t i = 0; i < p->win.size; i++)
+    if (p->win.ent[i].state != PROBE_FREE)
+      stat_add(p->lag, p->win.ent[i].lag / 1000000.0);
+}
 
-  memset(&stat, 0, sizeof(stat));
-  stat.tmin = 999999999.0;
+/* Final statistics, once the last step has returned */
+void ping_finish(t_pset *s) {
+  pace_free(&s->pace);
+  /* Probes still unanswered are lost, in the records as in the summary */
+  for (size_t i = 0; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[i];
 
-  printf("PING %s (%s): %zu data bytes", p->hostname,
-         inet_ntoa(p->dst.sin_addr), p->data_size);
-  if (opts & OPT_VERBOSE)
-    printf(", id 0x%04x = %u", p->id, p->id);
-  printf("\n");
-  fflush(stdout);
+    if (p->lag)
+      lag_finish(p);
+    seqwin_finish(&p->win);
+  }
+  print_summary(s);
+  if (!s->opt.format && (s->opt.rate || s->opts & OPT_VERBOSE))
+    print_pacing(&s->out, &s->pace);
+  ob_flush(&s->out);
+}
 
-  signal(SIGINT, sig_int);
-  rc = run(p);
+/* The whole run, from its own threads if asked to */
+int ping_exec(t_pset *s) {
+  int rc;
 
-  print_stat(p);
-  return rc;
+  if ((rc = ping_start(s)))
+    return rc;
+  if (s->opts & OPT_THREADS)
+    rc = thread_exec(s, &s->pace, run);
+  else
+    while (!(rc = ping_step(s)))
+      ;
+  ping_finish(s);
+  return rc < 0 ? -1 : 0;
 }
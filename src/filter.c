@@ -0,0 +1,132 @@
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+
+#include "ping.h"
+
+/*
+ * Classic BPF program accepting only the packets ping_process() would keep:
+ * echo replies carrying our identifier, and ICMP errors quoting one of our
+ * echo requests.  Everything else is dropped before it wakes us up.
+ *
+ * Packets start with the IP header, both on the raw socket and on the
+ * datagram packet socket of the receive ring.  Jumps to the labels below
+ * are resolved once the program is complete.
+ */
+
+enum { L_DST = 253, L_DROP, L_ACCEPT };
+
+typedef struct filter {
+  struct sock_filter code[FILTER_MAX];
+  size_t len;
+  size_t label[3]; /* Position of L_DST, L_DROP and L_ACCEPT */
+} t_filter;
+
+static void emit(t_filter *f, unsigned short op, unsigned char jt,
+                 unsigned char jf, unsigned int k) {
+  f->code[f->len++] = (struct sock_filter)BPF_JUMP(op, k, jt, jf);
+}
+
+static void stmt(t_filter *f, unsigned short op, unsigned int k) {
+  emit(f, op, 0, 0, k);
+}
+
+static void label(t_filter *f, int l) { f->label[l - L_DST] = f->len; }
+
+static void resolve(t_filter *f) {
+  for (size_t i = 0; i < f->len; i++) {
+    struct sock_filter *c = &f->code[i];
+
+    if (BPF_CLASS(c->code) != BPF_JMP)
+      continue;
+    if (c->jt >= L_DST)
+      c->jt = f->label[c->jt - L_DST] - i - 1;
+    if (c->jf >= L_DST)
+      c->jf = f->label[c->jf - L_DST] - i - 1;
+  }
+}
+
+static void build(t_pset *s, t_filter *f, int ring) {
+  unsigned int id = ntohs(s->id);
+
+  f->len = 0;
+  if (ring) {
+    /* Our own requests, seen on the way out */
+    stmt(f, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+    emit(f, BPF_JMP | BPF_JEQ | BPF_K, L_DROP, 0, PACKET_OUTGOING);
+  }
+  stmt(f, BPF_LD | BPF_B | BPF_ABS, offsetof(struct ip, ip_p));
+  emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, L_DROP, IPPROTO_ICMP);
+  /* Later fragments have no ICMP header */
+  stmt(f, BPF_LD | BPF_H | BPF_ABS, offsetof(struct ip, ip_off));
+  emit(f, BPF_JMP | BPF_JSET | BPF_K, L_DROP, 0, IP_OFFMASK);
+
+  /* X = offset of the ICMP header */
+  stmt(f, BPF_LDX | BPF_B | BPF_MSH, 0);
+  stmt(f, BPF_LD | BPF_B | BPF_IND, offsetof(icmphdr_t, icmp_type));
+  emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, 2, ICMP_ECHOREPLY);
+  stmt(f, BPF_LD | BPF_H | BPF_IND, offsetof(icmphdr_t, icmp_id));
+  emit(f, BPF_JMP | BPF_JEQ | BPF_K, L_ACCEPT, L_DROP, id);
+  emit(f, BPF_JMP | BPF_JEQ | BPF_K, L_DROP, 0, ICMP_ECHO);
+
+  /* Error quoting an ICMP packet sent to one of the destinations */
+  stmt(f, BPF_LD | BPF_B | BPF_IND,
+       offsetof(icmphdr_t, icmp_ip) + offsetof(struct ip, ip_p));
+  emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, L_DROP, IPPROTO_ICMP);
+  /* Not before every name has resolved */
+  if (s->ntargets <= FILTER_MAX_DST && !s->dns) {
+    size_t n = 0, k = 0;
+
+    for (size_t i = 0; i < s->ntargets; i++)
+      n += s->targets[i].state == TARGET_LIVE;
+    stmt(f, BPF_LD | BPF_W | BPF_IND,
+         offsetof(icmphdr_t, icmp_ip) + offsetof(struct ip, ip_dst));
+    for (size_t i = 0; i < s->ntargets; i++)
+      if (s->targets[i].state == TARGET_LIVE)
+        emit(f, BPF_JMP | BPF_JEQ | BPF_K, L_DST, ++k < n ? 0 : L_DROP,
+             ntohl(s->targets[i].dst.sin_addr.s_addr));
+  }
+  label(f, L_DST);
+
+  /* X += length of the quoted IP header */
+  stmt(f, BPF_LD | BPF_B | BPF_IND, offsetof(icmphdr_t, icmp_ip));
+  stmt(f, BPF_ALU | BPF_AND | BPF_K, 0xf);
+  stmt(f, BPF_ALU | BPF_LSH | BPF_K, 2);
+  stmt(f, BPF_ALU | BPF_ADD | BPF_X, 0);
+  stmt(f, BPF_MISC | BPF_TAX, 0);
+  stmt(f, BPF_LD | BPF_B | BPF_IND,
+       offsetof(icmphdr_t, icmp_ip) + offsetof(icmphdr_t, icmp_type));
+  emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, L_DROP, ICMP_ECHO);
+  stmt(f, BPF_LD | BPF_H | BPF_IND,
+       offsetof(icmphdr_t, icmp_ip) + offsetof(icmphdr_t, icmp_id));
+  emit(f, BPF_JMP | BPF_JEQ | BPF_K, L_ACCEPT, L_DROP, id);
+
+  label(f, L_DROP);
+  stmt(f, BPF_RET | BPF_K, 0);
+  label(f, L_ACCEPT);
+  stmt(f, BPF_RET | BPF_K, 0xffffffff);
+  resolve(f);
+}
+
+/* Filter whichever socket replies are read from */
+int filter_attach(t_pset *s) {
+  int ring = s->ring.fd >= 0;
+  struct sock_fprog prog;
+  t_filter f;
+
+  /* Datagram sockets are demultiplexed by the kernel already */
+  if ((s->dgram && !ring) || s->sim)
+    return 0;
+  build(s, &f, ring);
+  prog.len = f.len;
+  prog.filter = f.code;
+  if (setsockopt(ring ? s->ring.fd : s->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                 &prog, sizeof(prog)) < 0) {
+    perror("setsockopt(SO_ATTACH_FILTER)");
+    return -1;
+  }
+  return 0;
+}
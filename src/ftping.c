@@ -0,0 +1,142 @@
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ping.h"
+
+/*
+ * Embedding API.  A session is a ping set with its options; the command
+ * line is one user of it among others.  Setting up a session opens its
+ * sockets, which may need privilege, so callers drop theirs afterwards.
+ */
+
+void ftping_defaults(t_popt *opt, size_t *opts) {
+  memset(opt, 0, sizeof(*opt));
+  opt->data_size = DATA_SIZE;
+  opt->ttl = -1;
+  opt->out_fd = STDOUT_FILENO;
+  *opts = 0;
+}
+
+t_ftping *ftping_new(const t_popt *opt, size_t opts) {
+  t_pset *s;
+
+  if (!(s = malloc(sizeof(*s)))) {
+    perror("ftping_new failed");
+    return NULL;
+  }
+  if (ping_init(s, opt, opts) ||
+      (s->opt.rx_iface && rxring_init(s, s->opt.rx_iface))) {
+    ftping_free(s);
+    return NULL;
+  }
+  return s;
+}
+
+void ftping_free(t_ftping *s) {
+  if (!s)
+    return;
+  ping_reset(s);
+  free(s);
+}
+
+void ftping_callbacks(t_ftping *s, const t_ftcb *cb) { s->cb = *cb; }
+
+int ftping_add(t_ftping *s, const char *host) { return target_add(s, host); }
+
+int ftping_load(t_ftping *s, const char *path) {
+  return target_load(s, path);
+}
+
+/*
+ * Everything between the last target added and the first probe.  Names go
+ * on resolving once the first of them has, unless another thread matches
+ * the replies or the capture header needs every address.
+ */
+int ping_setup(t_pset *s) {
+  int wait = s->opts & OPT_THREADS || s->opt.capture;
+
+  if (wait && dns_resolve(s))
+    return -1;
+  if (!s->ntargets) {
+    fprintf(stderr, "ft_ping: no destinations to ping\n");
+    return -1;
+  }
+  if (target_index(s) || (!wait && dns_start(s)) || filter_attach(s) ||
+      data_init(s) || buffer_init(s) ||
+      (s->opt.rto_min && rto_init(s)) ||
+      (s->opts & OPT_URING && uring_init(s)) ||
+      (!(s->opts & OPT_NUMERIC) && !s->opt.format && resolv_init(s)) ||
+      (s->opts & OPT_KERNTS && tstamp_init(s)) || report_init(s) ||
+      (s->opt.capture && capture_open(s, s->opt.capture)))
+    return -1;
+  return 0;
+}
+
+/* Threaded and sharded sessions have their own loops, and only run whole */
+int ftping_start(t_ftping *s) {
+  if (s->opts & OPT_THREADS || s->nshards) {
+    fprintf(stderr, "ft_ping: threaded sessions cannot be stepped\n");
+    return -1;
+  }
+  return ping_setup(s) || ping_start(s) ? -1 : 0;
+}
+
+int ftping_step(t_ftping *s) { return ping_step(s); }
+
+void ftping_finish(t_ftping *s) { ping_finish(s); }
+
+int ftping_run(t_ftping *s) {
+  if (s->nshards)
+    return shard_exec(s);
+  return ping_setup(s) ? -1 : ping_exec(s);
+}
+
+/* Safe from a signal handler or another thread */
+void ftping_stop(t_ftping *s) {
+  atomic_store(&s->stop, 1);
+  shard_stop(s);
+}
+
+size_t ftping_ntargets(t_ftping *s) { return s->ntargets; }
+
+int ftping_stats(t_ftping *s, size_t target, t_ftstats *st) {
+  t_pinfo *p;
+
+  if (target >= s->ntargets)
+    return -1;
+  p = &s->targets[target];
+  memset(st, 0, sizeof(*st));
+  st->sent = p->num_xmit;
+  st->received = p->num_recv;
+  st->dup = p->num_rept;
+  st->errors = p->num_err;
+  st->lost = p->win.lost;
+  st->late = p->win.late;
+  st->reordered = p->win.reord;
+  if (p->srtt) {
+    st->srtt = p->srtt / 1000000.0;
+    st->rttvar = p->rttvar / 1000000.0;
+  }
+  st->rto = p->rto / 1000000.0;
+  if (p->lag && p->lag->hist.count) {
+    st->lag_avg = p->lag->tsum / p->lag->hist.count;
+    st->lag_max = p->lag->tmax;
+  }
+  if (!p->stat.hist.count)
+    return 0;
+  st->min = p->stat.tmin;
+  st->avg = p->stat.tsum / p->stat.hist.count;
+  st->max = p->stat.tmax;
+  st->p50 = stat_percentile(&p->stat, 50);
+  st->p90 = stat_percentile(&p->stat, 90);
+  st->p99 = stat_percentile(&p->stat, 99);
+  if (p->ostat && p->ostat->hist.count) {
+    st->ip50 = stat_percentile(p->ostat, 50);
+    st->ip99 = stat_percentile(p->ostat, 99);
+  }
+  return 0;
+}
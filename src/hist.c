@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+
+static unsigned int hist_index(uint64_t v) {
+  unsigned int shift;
+
+  if (v >= (1ULL << HIST_MAX_BITS))
+    v = (1ULL << HIST_MAX_BITS) - 1;
+  if (v < 2 * HIST_SUB)
+    return v;
+  shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+  return shift * HIST_SUB + (v >> shift);
+}
+
+/* Value in the middle of the range counted by bucket idx */
+static uint64_t hist_value(unsigned int idx) {
+  unsigned int shift;
+
+  if (idx < 2 * HIST_SUB)
+    return idx;
+  shift = idx / HIST_SUB - 1;
+  return ((uint64_t)(idx % HIST_SUB + HIST_SUB) << shift) +
+         (1ULL << (shift - 1));
+}
+
+int hist_init(t_hist *h) {
+  memset(h, 0, sizeof(*h));
+  h->lo = HIST_SIZE;
+  return (h->counts = calloc(HIST_SIZE, sizeof(*h->counts))) ? 0 : -1;
+}
+
+/* Only the buckets in use have anything to clear */
+void hist_reset(t_hist *h) {
+  if (h->lo < h->hi)
+    memset(h->counts + h->lo, 0, (h->hi - h->lo) * sizeof(*h->counts));
+  h->count = 0;
+  h->lo = HIST_SIZE;
+  h->hi = 0;
+}
+
+void hist_add(t_hist *h, uint64_t ns) {
+  unsigned int idx = hist_index(ns);
+
+  h->counts[idx]++;
+  h->count++;
+  if (idx < h->lo)
+    h->lo = idx;
+  if (idx >= h->hi)
+    h->hi = idx + 1;
+}
+
+void hist_merge(t_hist *dst, const t_hist *src) {
+  for (unsigned int i = src->lo; i < src->hi; i++)
+    dst->counts[i] += src->counts[i];
+  dst->count += src->count;
+  if (src->lo < dst->lo)
+    dst->lo = src->lo;
+  if (src->hi > dst->hi)
+    dst->hi = src->hi;
+}
+
+uint64_t hist_percentile(const t_hist *h, double pct) {
+  double want = pct / 100.0 * h->count;
+  uint64_t rank = want, seen = 0;
+
+  if (!h->count)
+    return 0;
+  if (rank < want || !rank)
+    rank++;
+  for (unsigned int i = h->lo; i < h->hi; i++)
+    if ((seen += h->counts[i]) >= rank)
+      return hist_value(i);
+  return hist_value(h->hi - 1);
+}
+
+void hist_free(t_hist *h) {
+  free(h->counts);
+  memset(h, 0, sizeof(*h));
+}
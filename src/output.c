@@ -0,0 +1,159 @@
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+int ob_init(t_obuf *ob, int fd, size_t size) {
+  memset(ob, 0, sizeof(*ob));
+  if (!(ob->buf = malloc(size))) {
+    perror("ob_init failed");
+    return -1;
+  }
+  ob->size = size;
+  ob->fd = fd;
+  return 0;
+}
+
+void ob_free(t_obuf *ob) {
+  if (ob->buf)
+    ob_flush(ob);
+  free(ob->buf);
+  ob->buf = NULL;
+}
+
+int ob_flush(t_obuf *ob) {
+  size_t off = 0;
+  ssize_t n;
+
+  while (off < ob->len) {
+    n = write(ob->fd, ob->buf + off, ob->len - off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    off += n;
+  }
+  ob->len = 0;
+  return off ? 0 : -1;
+}
+
+/* Make sure that n more bytes fit without flushing in the middle */
+void ob_reserve(t_obuf *ob, size_t n) {
+  if (ob->len + n > ob->size)
+    ob_flush(ob);
+}
+
+static void ob_write(t_obuf *ob, const char *s, size_t n) {
+  while (n) {
+    size_t room;
+
+    if (ob->len == ob->size)
+      ob_flush(ob);
+    room = ob->size - ob->len;
+    if (room > n)
+      room = n;
+    memcpy(ob->buf + ob->len, s, room);
+    ob->len += room;
+    s += room;
+    n -= room;
+  }
+}
+
+void ob_putc(t_obuf *ob, char c) {
+  if (ob->len == ob->size)
+    ob_flush(ob);
+  ob->buf[ob->len++] = c;
+}
+
+void ob_puts(t_obuf *ob, const char *s) { ob_write(ob, s, strlen(s)); }
+
+void ob_putu(t_obuf *ob, uint64_t v) {
+  char tmp[20];
+  int i = sizeof(tmp);
+
+  do {
+    tmp[--i] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  ob_write(ob, tmp + i, sizeof(tmp) - i);
+}
+
+/* Fixed point with the given number of decimals, rounded half up */
+void ob_putfix(t_obuf *ob, double v, int decimals) {
+  uint64_t scale = 1, n, frac;
+  char tmp[20];
+  int i;
+
+  if (v < 0) {
+    ob_putc(ob, '-');
+    v = -v;
+  }
+  for (i = 0; i < decimals; i++)
+    scale *= 10;
+  n = v * scale + 0.5;
+  ob_putu(ob, n / scale);
+  if (!decimals)
+    return;
+
+  ob_putc(ob, '.');
+  frac = n % scale;
+  for (i = decimals; i > 0; i--) {
+    tmp[i - 1] = '0' + frac % 10;
+    frac /= 10;
+  }
+  ob_write(ob, tmp, decimals);
+}
+
+/* JSON string literal, quotes included */
+void ob_putjstr(t_obuf *ob, const char *s) {
+  ob_putc(ob, '"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      ob_putc(ob, '\\');
+    if ((unsigned char)*s < 0x20)
+      continue;
+    ob_putc(ob, *s);
+  }
+  ob_putc(ob, '"');
+}
+
+/* Dotted quad, like inet_ntoa() without its static buffer */
+void ob_putip(t_obuf *ob, struct in_addr in) {
+  unsigned char *b = (unsigned char *)&in.s_addr;
+
+  for (int i = 0; i < 4; i++) {
+    if (i)
+      ob_putc(ob, '.');
+    ob_putu(ob, b[i]);
+  }
+}
+
+/*
+ * Formatted in place, for the lines that are not worth formatting by hand.
+ * A line longer than the whole buffer is truncated.
+ */
+void ob_printf(t_obuf *ob, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  ob_reserve(ob, OBUF_RECORD);
+  va_start(ap, fmt);
+  n = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if ((size_t)n >= ob->size - ob->len && ob->len) {
+    ob_flush(ob);
+    va_start(ap, fmt);
+    n = vsnprintf(ob->buf, ob->size, fmt, ap);
+    va_end(ap);
+  }
+  ob->len += MIN((size_t)n, ob->size - ob->len - 1);
+}
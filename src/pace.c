@@ -0,0 +1,143 @@
+#include <sys/param.h>
+#include <sys/timerfd.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ping.h"
+
+/*
+ * Send scheduler.  Slot k is due at start + k * num / den nanoseconds, an
+ * absolute schedule which does not drift however late the loop wakes up.
+ * Slots missed by a late wakeup are caught up, but never more than
+ * PACE_BURST of them back to back: the rest are given up so that the
+ * output rate never exceeds the requested one for more than a few packets.
+ * The caller sets the start time once it is ready to send.
+ *
+ * Open loop schedules never give a slot up: however late the loop is, every
+ * slot is sent, PACE_BURST at a time, and the sender accounts for how late
+ * it was.  The slots are evenly spaced, or come in bursts of back to back
+ * slots at the same average rate, or arrive as a Poisson process whose gaps
+ * are drawn as the schedule goes, from a generator seeded by the caller.
+ */
+
+/* The fraction is kept reduced, so that the products below stay small */
+int pace_init(t_pacer *t, long long num, long long den) {
+  long long a = num, b = den;
+
+  while (b) {
+    long long r = a % b;
+
+    a = b;
+    b = r;
+  }
+  memset(t, 0, sizeof(*t));
+  t->num = num / a;
+  t->den = den / a;
+  if ((t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) <
+      0) {
+    perror("timerfd_create failed");
+    return -1;
+  }
+  return 0;
+}
+
+void pace_open(t_pacer *t, int sched, size_t burst, uint64_t seed) {
+  t->sched = sched;
+  t->burst = MAX(burst, 1);
+  t->rand = seed ? seed : 1;
+}
+
+void pace_free(t_pacer *t) {
+  if (t->fd >= 0)
+    close(t->fd);
+  t->fd = -1;
+}
+
+/* Exponential gap of the given mean, from a xorshift64* uniform in (0, 1) */
+static long long pace_gap(t_pacer *t, double mean) {
+  double u;
+
+  t->rand ^= t->rand >> 12;
+  t->rand ^= t->rand << 25;
+  t->rand ^= t->rand >> 27;
+  u = ((t->rand * 0x2545f4914f6cdd1dULL >> 11) + 0.5) / (1ULL << 53);
+  return -log(u) * mean + 0.5;
+}
+
+/*
+ * Poisson due times are drawn in order and only the last PACE_BURST of them
+ * are kept, which is as far back as pace_due() and its callers look.
+ */
+static long long pace_poisson(t_pacer *t, size_t slot) {
+  double mean = (double)t->num / t->den;
+
+  while (t->gen <= slot) {
+    long long prev = t->gen ? t->due[(t->gen - 1) % PACE_BURST] : t->start;
+
+    t->due[t->gen % PACE_BURST] = prev + pace_gap(t, mean);
+    t->gen++;
+  }
+  return t->due[slot % PACE_BURST];
+}
+
+/* Due time of a slot, computed without overflowing the product */
+long long pace_time(t_pacer *t, size_t slot) {
+  if (t->sched == OPEN_POISSON)
+    return pace_poisson(t, slot);
+  if (t->sched == OPEN_BURST)
+    slot -= slot % t->burst;
+  return t->start + slot / t->den * t->num + slot % t->den * t->num / t->den;
+}
+
+/* Number of slots to be used now */
+size_t pace_due(t_pacer *t, long long now) {
+  long long d = now - t->start;
+  size_t end, n;
+
+  if (now < pace_time(t, t->slot))
+    return 0;
+  if (t->sched) {
+    for (n = 1; n < PACE_BURST && pace_time(t, t->slot + n) <= now; n++)
+      ;
+    return n;
+  }
+  /* End of the due slots, give or take the rounding of their due times */
+  end = (size_t)(d / t->num) * t->den + d % t->num * t->den / t->num + 1;
+  n = end > t->slot ? end - t->slot : 1;
+  if (n > PACE_BURST) {
+    t->skipped += n - PACE_BURST;
+    t->slot += n - PACE_BURST;
+    n = PACE_BURST;
+  }
+  return n;
+}
+
+/* A slot given up without sending, not to be counted as one sent */
+void pace_pass(t_pacer *t) { t->slot++; }
+
+void pace_sent(t_pacer *t, long long now) {
+  if (!t->sent++)
+    t->first = now;
+  t->last = now;
+  t->slot++;
+}
+
+/* Have the timer descriptor become readable at the given time */
+int pace_arm(t_pacer *t, long long wake) {
+  struct itimerspec its = {.it_value = {.tv_sec = wake / 1000000000LL,
+                                        .tv_nsec = wake % 1000000000LL}};
+
+  return timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Packets per second the schedule asks for, and the one achieved */
+double pace_requested(t_pacer *t) { return t->den * 1e9 / t->num; }
+
+double pace_achieved(t_pacer *t) {
+  if (t->sent < 2 || t->last == t->first)
+    return 0;
+  return (t->sent - 1) * 1e9 / (t->last - t->first);
+}
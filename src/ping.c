@@ -1,30 +1,35 @@
 #include <asm-generic/socket.h>
+#include <sys/prctl.h>
 #include <errno.h>
 #include <error.h>
+#include <getopt.h>
 #include <limits.h>
 #include <memory.h>
+#include <sched.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include "ping.h"
+#include "ftping.h"
+#include "icmp.h"
 
 #define MAX_DATA_SIZE (65535 - MAXIPLEN - MAXICMPLEN)
 #define MAX_PTRN_SIZE 16
 
-size_t opts = 0;
-t_popt opt_vals;
-
 static void print_usage() {
   printf("Usage\n"
-         "  ft_ping [options] <destination>\n\n"
+         "  ft_ping [options] <destination> [<destination>...]\n\n"
          "Options:\n"
          "  <destination>      dns name or ip address\n"
          "  -c <count>         stop after <count> replies\n"
          "  -f                 flood ping\n"
+         "  -F <file>          read destinations from <file>, one per line\n"
          "  -h                 print help and exit\n"
+         "  -i <interval>      wait <interval> seconds between sending each "
+         "packet\n"
          "  -l <preload>       send <preload> number of packages while waiting "
          "replies\n"
          "  -n                 no dns name resolution\n"
@@ -37,7 +42,44 @@ static void print_usage() {
          "  -T <tos>           set type of service (TOS)\n"
          "  -v                 verbose output\n"
          "  -w <deadline>      reply wait <deadline> in seconds\n"
-         "  -W <timeout>       time to wait for response\n");
+         "  -W <timeout>       time to wait for response\n"
+         "      --batch <n>    send and receive up to <n> packets per "
+         "syscall\n"
+         "      --capture <file>\n"
+         "                     log every probe and reply to <file>\n"
+         "      --dns-cache <file>\n"
+         "                     cache host name resolutions in <file>\n"
+         "      --kernel-ts    time replies with kernel timestamps\n"
+         "      --rate <n>[pps]\n"
+         "                     send <n> packets per second in total\n"
+         "      --threads      send, receive and print from separate "
+         "threads\n"
+         "      --io-uring     wait, send and receive through io_uring\n"
+         "      --rx-ring <iface>\n"
+         "                     receive through a memory mapped ring on "
+         "<iface>\n"
+         "      --replay <file>\n"
+         "                     print the statistics of a capture log\n"
+         "      --open-loop <const|poisson[:<seed>]|burst:<n>>\n"
+         "                     send on schedule however late, timing replies "
+         "from\n"
+         "                     the intended send times as well\n"
+         "      --rto[=<min>]  time every probe out after a smoothed round "
+         "trip\n"
+         "                     estimate, at least <min> ms (default %d)\n"
+         "      --shards <n>   spread the destinations over <n> threads, each "
+         "with\n"
+         "                     its own socket and CPU\n"
+         "      --sim <spec>   ping a simulated network instead, e.g. "
+         "delay=10,jitter=2,\n"
+         "                     dist=normal,loss=1,dup=0.1,err=0.1,seed=42\n"
+         "      --window <n>   track up to <n> outstanding probes per "
+         "destination\n"
+         "      --format <fmt> print records as json (JSON Lines) or csv\n"
+         "      --report-interval <sec>\n"
+         "                     print aggregate records every <sec> "
+         "seconds\n",
+         RTO_MIN_DFLT);
 }
 
 static size_t decode_pattern(const char *arg, unsigned char *pattern_data) {
@@ -71,108 +113,269 @@ static size_t validate_arg(const char *arg, size_t max_val, int allow_zero) {
   return n;
 }
 
-static int parse_args(int argc, char *argv[]) {
+static void parse_open_loop(const char *arg, t_popt *opt) {
+  if (!strcmp(arg, "const"))
+    opt->open_loop = OPEN_CONST;
+  else if (!strcmp(arg, "poisson"))
+    opt->open_loop = OPEN_POISSON;
+  else if (!strncmp(arg, "poisson:", 8)) {
+    char *end;
+
+    opt->open_loop = OPEN_POISSON;
+    opt->seed = strtoull(arg + 8, &end, 0);
+    if (end == arg + 8 || *end)
+      error(EXIT_FAILURE, 0, "invalid seed (%s)", arg + 8);
+  } else if (!strncmp(arg, "burst:", 6)) {
+    opt->open_loop = OPEN_BURST;
+    opt->burst = validate_arg(arg + 6, INT_MAX, 0);
+  } else
+    error(EXIT_FAILURE, 0, "unknown schedule %s", arg);
+}
+
+static long long parse_interval(const char *arg) {
+  char *p;
+  double sec;
+
+  sec = strtod(arg, &p);
+  if (*p || sec < 0)
+    error(EXIT_FAILURE, 0, "invalid interval value (%s)", arg);
+  if (sec < 1e-6 || sec > INT_MAX)
+    error(EXIT_FAILURE, 0, "option value out of range: %s", arg);
+  return sec * 1000000000.0 + 0.5;
+}
+
+static size_t parse_rate(const char *arg) {
+  char *p;
+  unsigned long n;
+
+  n = strtoul(arg, &p, 0);
+  if (p == arg || (*p && strcmp(p, "pps")))
+    error(EXIT_FAILURE, 0, "invalid rate value (%s)", arg);
+  if (n == 0 || n > 1000000000)
+    error(EXIT_FAILURE, 0, "option value out of range: %s", arg);
+  return n;
+}
+
+enum {
+  ARG_BATCH = 256,
+  ARG_KERNTS,
+  ARG_WINDOW,
+  ARG_FORMAT,
+  ARG_REPORT,
+  ARG_RATE,
+  ARG_THREADS,
+  ARG_RXRING,
+  ARG_URING,
+  ARG_DNSCACHE,
+  ARG_CAPTURE,
+  ARG_REPLAY,
+  ARG_SIM,
+  ARG_SHARDS,
+  ARG_OPENLOOP,
+  ARG_RTO
+};
+
+static const struct option long_opts[] = {
+    {"batch", required_argument, NULL, ARG_BATCH},
+    {"kernel-ts", no_argument, NULL, ARG_KERNTS},
+    {"window", required_argument, NULL, ARG_WINDOW},
+    {"format", required_argument, NULL, ARG_FORMAT},
+    {"report-interval", required_argument, NULL, ARG_REPORT},
+    {"rate", required_argument, NULL, ARG_RATE},
+    {"threads", no_argument, NULL, ARG_THREADS},
+    {"rx-ring", required_argument, NULL, ARG_RXRING},
+    {"io-uring", no_argument, NULL, ARG_URING},
+    {"dns-cache", required_argument, NULL, ARG_DNSCACHE},
+    {"capture", required_argument, NULL, ARG_CAPTURE},
+    {"replay", required_argument, NULL, ARG_REPLAY},
+    {"sim", required_argument, NULL, ARG_SIM},
+    {"shards", required_argument, NULL, ARG_SHARDS},
+    {"open-loop", required_argument, NULL, ARG_OPENLOOP},
+    {"rto", optional_argument, NULL, ARG_RTO},
+    {NULL, 0, NULL, 0},
+};
+
+static int parse_args(int argc, char *argv[], t_popt *opt, size_t *opts,
+                      const char **target_file) {
   static unsigned char pattern[MAX_PTRN_SIZE];
-  int opt;
+  size_t n;
+  int c;
   char *endptr;
 
-  opt_vals.interval = DFLT_INTVL;
-  opt_vals.data_size = DATA_SIZE;
-  opt_vals.ttl = -1;
-
-  while ((opt = getopt(argc, argv, "c:fhl:np:qrs:t:T:vw:W:")) != -1) {
-    switch (opt) {
+  while ((c = getopt_long(argc, argv, "c:fF:hi:l:np:qrs:t:T:vw:W:", long_opts,
+                            NULL)) != -1) {
+    switch (c) {
     case 'c':
-      opt_vals.count = validate_arg(optarg, INT_MAX, 0);
+      opt->count = validate_arg(optarg, INT_MAX, 0);
       break;
     case 'f':
-      opts |= OPT_FLOOD;
+      *opts |= OPT_FLOOD;
+      break;
+    case 'F':
+      *target_file = optarg;
       break;
     case 'h':
       print_usage();
       exit(0);
+    case 'i':
+      opt->interval = parse_interval(optarg);
+      break;
     case 'l':
-      opt_vals.preload = strtoul(optarg, &endptr, 0);
-      if (*endptr || opt_vals.preload > INT_MAX)
+      opt->preload = strtoul(optarg, &endptr, 0);
+      if (*endptr || opt->preload > INT_MAX)
         error(EXIT_FAILURE, 0, "invalid preload value (%s)", optarg);
       break;
     case 'n':
-      opts |= OPT_NUMERIC;
+      *opts |= OPT_NUMERIC;
       break;
     case 'p':
-      opt_vals.ptrn_size = decode_pattern(optarg, pattern);
-      opt_vals.ptrn = pattern;
+      opt->ptrn_size = decode_pattern(optarg, pattern);
+      opt->ptrn = pattern;
       break;
     case 'q':
-      opts |= OPT_QUIET;
+      *opts |= OPT_QUIET;
       break;
     case 'r':
-      opt_vals.socket_type |= SO_DONTROUTE;
+      opt->socket_type |= SO_DONTROUTE;
       break;
     case 's':
-      opt_vals.data_size = validate_arg(optarg, MAX_DATA_SIZE, 1);
+      opt->data_size = validate_arg(optarg, MAX_DATA_SIZE, 1);
       break;
     case 't':
-      opt_vals.ttl = validate_arg(optarg, 255, 0);
+      opt->ttl = validate_arg(optarg, 255, 0);
       break;
     case 'T':
-      opt_vals.tos = validate_arg(optarg, 255, 1);
+      opt->tos = validate_arg(optarg, 255, 1);
       break;
     case 'v':
-      opts |= OPT_VERBOSE;
+      *opts |= OPT_VERBOSE;
       break;
     case 'w':
-      opt_vals.timeout = validate_arg(optarg, INT_MAX, 0);
+      opt->timeout = validate_arg(optarg, INT_MAX, 0);
       break;
     case 'W':
-      opt_vals.linger = validate_arg(optarg, INT_MAX, 0);
+      opt->linger = validate_arg(optarg, INT_MAX, 0);
+      break;
+    case ARG_BATCH:
+      opt->batch = validate_arg(optarg, IOV_MAX, 0);
+      break;
+    case ARG_KERNTS:
+      *opts |= OPT_KERNTS;
+      break;
+    case ARG_WINDOW:
+      n = validate_arg(optarg, SEQWIN_MAX, 0);
+      for (opt->window = 1; opt->window < n;)
+        opt->window <<= 1;
+      break;
+    case ARG_FORMAT:
+      if (!strcmp(optarg, "json"))
+        opt->format = FMT_JSON;
+      else if (!strcmp(optarg, "csv"))
+        opt->format = FMT_CSV;
+      else
+        error(EXIT_FAILURE, 0, "unknown output format %s", optarg);
+      break;
+    case ARG_REPORT:
+      opt->report_intvl = validate_arg(optarg, INT_MAX, 0);
+      break;
+    case ARG_RATE:
+      opt->rate = parse_rate(optarg);
+      break;
+    case ARG_THREADS:
+      *opts |= OPT_THREADS;
+      break;
+    case ARG_RXRING:
+      opt->rx_iface = optarg;
+      break;
+    case ARG_URING:
+      *opts |= OPT_URING;
+      break;
+    case ARG_DNSCACHE:
+      opt->dns_cache = optarg;
+      break;
+    case ARG_CAPTURE:
+      opt->capture = optarg;
+      break;
+    case ARG_REPLAY:
+      opt->replay = optarg;
+      break;
+    case ARG_SIM:
+      opt->sim = optarg;
+      break;
+    case ARG_OPENLOOP:
+      parse_open_loop(optarg, opt);
+      break;
+    case ARG_RTO:
+      opt->rto_min = optarg ? validate_arg(optarg, RTO_MAX, 0) : RTO_MIN_DFLT;
+      break;
+    case ARG_SHARDS:
+      opt->shards = validate_arg(optarg, CPU_SETSIZE, 0);
       break;
     default:
       print_usage();
       return -1;
     }
   }
-  if (optind >= argc) {
+  if (opt->report_intvl && !opt->format)
+    error(EXIT_FAILURE, 0, "--report-interval requires --format");
+  if (opt->rate && opt->interval)
+    error(EXIT_FAILURE, 0, "-i and --rate are mutually exclusive");
+  if (*opts & OPT_URING && (*opts & OPT_THREADS || opt->rx_iface))
+    error(EXIT_FAILURE, 0, "--io-uring excludes --threads and --rx-ring");
+  if (opt->sim &&
+      (*opts & (OPT_THREADS | OPT_URING | OPT_KERNTS) || opt->rx_iface))
+    error(EXIT_FAILURE, 0,
+          "--sim excludes --threads, --io-uring, --kernel-ts and --rx-ring");
+  if (opt->shards > 1 &&
+      (*opts & OPT_THREADS || opt->rx_iface || opt->capture))
+    error(EXIT_FAILURE, 0,
+          "--shards excludes --threads, --rx-ring and --capture");
+  if (optind >= argc && !*target_file && !opt->replay) {
     fprintf(stderr, "ft_ping: usage error: Destination address required\n");
     return -1;
   }
   return 0;
 }
 
+static t_ftping *session;
+
+static void sig_int(int signal __attribute__((unused))) {
+  if (session)
+    ftping_stop(session);
+}
+
 int main(int argc, char *argv[]) {
-  t_pinfo ping;
-  int rc, one = 1;
+  const char *target_file = NULL;
+  size_t opts;
+  t_popt opt;
+  int rc;
 
-  memset(&opt_vals, 0, sizeof(opt_vals));
-  if ((rc = parse_args(argc, argv)))
-    return rc;
-  if ((rc = ping_init(&ping)))
+  ftping_defaults(&opt, &opts);
+  if ((rc = parse_args(argc, argv, &opt, &opts, &target_file)))
     return rc;
+  if (opt.replay)
+    return ftping_replay(&opt, opt.replay);
+  if (!(session = ftping_new(&opt, opts)))
+    return EXIT_FAILURE;
 
-  setsockopt(ping.fd, SOL_SOCKET, SO_BROADCAST, (char *)&one, sizeof(one));
-
+  /* The sockets are open, privilege is no longer needed */
   if (setuid(getuid()) != 0)
     error(EXIT_FAILURE, errno, "setuid");
 
-  if (opt_vals.socket_type != 0)
-    setsockopt(ping.fd, SOL_SOCKET, opt_vals.socket_type, &one, sizeof(one));
-
-  if (opt_vals.ttl > 0)
-    if (setsockopt(ping.fd, IPPROTO_IP, IP_TTL, &opt_vals.ttl,
-                   sizeof(opt_vals.ttl)) < 0)
-      error(0, errno, "setsockopt(IP_TTL)");
-
-  if (opt_vals.tos >= 0)
-    if (setsockopt(ping.fd, IPPROTO_IP, IP_TOS, &opt_vals.tos,
-                   sizeof(opt_vals.tos)) < 0)
-      error(0, errno, "setsockopt(IP_TOS)");
-
-  if (set_dest(&ping, argv[optind]))
-    error(EXIT_FAILURE, 0, "unknown host");
-
-  if (!(rc = data_init()) && !(rc = buffer_init(&ping)))
-    rc = exec(&ping);
+  for (int i = optind; i < argc; i++)
+    if (ftping_add(session, argv[i]) < 0)
+      return EXIT_FAILURE;
+  if (target_file && ftping_load(session, target_file) < 0)
+    return EXIT_FAILURE;
 
-  ping_reset(&ping);
-  return rc;
+  /*
+   * The default timer slack of 50us would dwarf sub-millisecond periods.
+   * It is a per-thread setting, so the library leaves that of the threads
+   * embedding it alone and only tightens it on the threads it starts.
+   */
+  prctl(PR_SET_TIMERSLACK, 1UL);
+  signal(SIGINT, sig_int);
+  rc = ftping_run(session);
+  ftping_free(session);
+  return rc ? EXIT_FAILURE : 0;
 }
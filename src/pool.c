@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "icmp.h"
+#include "ping.h"
+
+/*
+ * Pool of pre-encoded echo requests.  Every packet carries the payload and
+ * a valid checksum from startup on, so sending one only patches the
+ * sequence number and timestamp.  There is one packet per transmit batch
+ * slot: a packet is not reused before the batch referencing it is sent.
+ */
+
+int pool_init(t_pset *s) {
+  size_t len = s->data_size + 8;
+  size_t off = TIMING(s->data_size) ? sizeof(struct timeval) : 0;
+
+  s->npool = s->tx.size ? s->tx.size : 1;
+  if (!(s->pool = calloc(s->npool, len))) {
+    perror("pool_init failed");
+    return -1;
+  }
+  for (size_t i = 0; i < s->npool; i++) {
+    unsigned char *pkt = s->pool + i * len;
+    icmphdr_t *icmp = (icmphdr_t *)pkt;
+
+    /* Timestamp starts out zero and does not contribute to the sum */
+    memcpy(icmp->icmp_data + off, s->opt.data, s->data_size - off);
+    icmp_echo_encode_sum(pkt, len, s->id, 0, s->opt.data_sum);
+  }
+  return 0;
+}
+
+void pool_free(t_pset *s) {
+  free(s->pool);
+  s->pool = NULL;
+}
+
+/* Packet to be used by the next send */
+unsigned char *pool_slot(t_pset *s) {
+  return s->pool + (s->tx.size ? s->tx.len : 0) * (s->data_size + 8);
+}
@@ -0,0 +1,210 @@
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "ping.h"
+
+/*
+ * Offline analysis of a capture log.  Records are accounted the way the
+ * live run accounted the events they come from, which gives the same
+ * statistics and histograms, and every probe answered is marked in a
+ * bitmap to describe the losses as bursts afterwards.
+ */
+
+typedef struct replay_map {
+  unsigned char *bits; /* Probes answered, by extended sequence number */
+  size_t size;         /* Bytes in bits */
+} t_preplay;
+
+static int replay_mark(t_preplay *m, size_t seq) {
+  if (seq / 8 >= m->size) {
+    size_t size = MAX(m->size * 2, seq / 8 + 1);
+    unsigned char *bits = realloc(m->bits, size);
+
+    if (!bits)
+      return -1;
+    memset(bits + m->size, 0, size - m->size);
+    m->bits = bits;
+    m->size = size;
+  }
+  m->bits[seq / 8] |= 1 << seq % 8;
+  return 0;
+}
+
+static void replay_reply(t_pset *s, t_pinfo *p, t_preplay *m,
+                         const t_pcaprec *r) {
+  t_pseqent *ent = seqwin_find(&p->win, r->seq);
+  double triptime = -1, overhead;
+  int seqclass;
+
+  if (ent) {
+    triptime = (r->time - ent->sent) / 1000000.0;
+    if (r->kts && ent->txts) {
+      overhead = MAX(triptime - (r->kts - ent->txts) / 1000000.0, 0.0);
+      triptime = (r->kts - ent->txts) / 1000000.0;
+      p->stat.osum += overhead;
+      p->stat.omax = MAX(p->stat.omax, overhead);
+      p->stat.nkern++;
+    }
+    replay_mark(m, ent->seq);
+  }
+  seqclass = seqwin_recv(&p->win, r->seq);
+  if (seqclass == SEQ_BOGUS)
+    return;
+  if (seqclass == SEQ_DUP)
+    p->num_rept++;
+  else if (seqclass != SEQ_LATE)
+    p->num_recv++;
+  /* Replies later than the window have lost their send time */
+  if (triptime >= 0 && TIMING(s->data_size))
+    stat_add(&p->stat, triptime);
+}
+
+static void replay_rec(t_pset *s, t_preplay *maps, const t_pcaprec *r) {
+  t_pinfo *p = &s->targets[r->target];
+  struct timeval tv;
+  t_pseqent *ent;
+
+  switch (r->type) {
+  case CAP_SEND:
+    tv.tv_sec = r->time / 1000000000LL;
+    tv.tv_usec = r->time % 1000000000LL / 1000;
+    seqwin_send(&p->win, &tv, 0);
+    p->num_sent++;
+    p->num_xmit++;
+    break;
+  case CAP_FAIL:
+    if ((ent = seqwin_find(&p->win, r->seq)))
+      ent->state = PROBE_FREE;
+    p->num_xmit--;
+    break;
+  case CAP_TXTS:
+    if ((ent = seqwin_find(&p->win, r->seq)))
+      ent->txts = r->kts;
+    break;
+  case CAP_REPLY:
+    replay_reply(s, p, &maps[r->target], r);
+    break;
+  case CAP_ERROR:
+    p->num_err++;
+    break;
+  }
+}
+
+/* Runs of consecutive unanswered probes */
+static void print_losses(t_obuf *ob, t_pinfo *p, t_preplay *m) {
+  size_t buckets[5] = {0}, nburst = 0, longest = 0, lost = 0, run = 0;
+
+  for (size_t i = 0; i <= p->num_sent; i++) {
+    if (i < p->num_sent && !(i / 8 < m->size && m->bits[i / 8] & 1 << i % 8)) {
+      run++;
+      continue;
+    }
+    if (!run)
+      continue;
+    nburst++;
+    lost += run;
+    longest = MAX(longest, run);
+    buckets[MIN(31 - __builtin_clz(run), 4)]++;
+    run = 0;
+  }
+  if (!nburst)
+    return;
+  ob_printf(ob, "--- %s losses ---\n", p->hostname);
+  ob_printf(ob, "%zu bursts, longest %zu probes, mean %.1f probes\n", nburst,
+            longest, (double)lost / nburst);
+  ob_printf(ob, "burst lengths 1:%zu 2-3:%zu 4-7:%zu 8-15:%zu 16+:%zu\n",
+            buckets[0], buckets[1], buckets[2], buckets[3], buckets[4]);
+}
+
+static int replay_targets(t_pset *s, const t_pcaphdr *h) {
+  const t_pcaptarget *t = (const t_pcaptarget *)(h + 1);
+
+  if (!(s->targets = calloc(h->ntargets, sizeof(*s->targets))))
+    return -1;
+  for (; s->ntargets < h->ntargets; s->ntargets++) {
+    t_pinfo *p = &s->targets[s->ntargets];
+
+    p->dst.sin_family = AF_INET;
+    p->dst.sin_addr.s_addr = t[s->ntargets].addr;
+    if (stat_init(&p->stat) ||
+        !(p->hostname = strndup(t[s->ntargets].name, sizeof(t->name))) ||
+        seqwin_init(&p->win, h->window)) {
+      stat_free(&p->stat);
+      free(p->hostname);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int ftping_replay(const t_popt *opt, const char *path) {
+  const t_pcaphdr *h;
+  const t_pcaprec *r, *end;
+  t_preplay *maps = NULL;
+  unsigned char *map;
+  struct stat st;
+  t_pset s;
+  int fd, rc = EXIT_FAILURE;
+
+  memset(&s, 0, sizeof(s));
+  s.opt = *opt;
+  s.tp = &sock_transport;
+  s.fd = s.wakefd = s.stopfd = s.ring.fd = s.pace.fd = -1;
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) ||
+      (map = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE,
+                  fd, 0)) == MAP_FAILED) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  h = (const t_pcaphdr *)map;
+  if ((size_t)st.st_size < sizeof(*h) ||
+      memcmp(h->magic, CAPTURE_MAGIC, sizeof(h->magic)) || !h->window ||
+      h->window & (h->window - 1) ||
+      (size_t)st.st_size < sizeof(*h) + h->ntargets * sizeof(t_pcaptarget)) {
+    fprintf(stderr, "ft_ping: %s: not a capture log\n", path);
+    goto out;
+  }
+  s.data_size = h->data_size;
+  s.id = h->id;
+  if (replay_targets(&s, h) ||
+      !(maps = calloc(h->ntargets, sizeof(*maps))) ||
+      ob_init(&s.out, opt->out_fd, OBUF_SIZE) || report_init(&s)) {
+    perror("replay failed");
+    goto out;
+  }
+
+  r = (const t_pcaprec *)(map + sizeof(*h) +
+                          h->ntargets * sizeof(t_pcaptarget));
+  end = r + (st.st_size - ((const unsigned char *)r - map)) / sizeof(*r);
+  for (; r < end && r->type != CAP_NONE; r++)
+    if (r->target < s.ntargets)
+      replay_rec(&s, maps, r);
+
+  for (size_t i = 0; i < s.ntargets; i++)
+    seqwin_finish(&s.targets[i].win);
+  print_summary(&s);
+  if (!s.opt.format)
+    for (size_t i = 0; i < s.ntargets; i++)
+      print_losses(&s.out, &s.targets[i], &maps[i]);
+  rc = 0;
+out:
+  for (size_t i = 0; maps && i < s.ntargets; i++)
+    free(maps[i].bits);
+  free(maps);
+  munmap(map, st.st_size ? st.st_size : 1);
+  ping_reset(&s);
+  return rc;
+}
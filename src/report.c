@@ -0,0 +1,281 @@
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "ping.h"
+
+/*
+ * Machine readable output: JSON Lines or CSV records.  Both formats share
+ * one column set; a CSV record leaves the columns it has no value for empty
+ * and a JSON record omits them.  Fields must be added in column order.  The
+ * columns of open loop runs come next: round trips from the intended send
+ * times and the lag of the sends behind their schedule.  The last is the
+ * deadline a probe that timed out was given, with --rto.
+ */
+
+static const char *columns[] = {
+    "type", "time",     "host", "addr", "seq", "ttl", "bytes", "rtt", "status",
+    "sent", "received", "dup",  "loss", "min", "avg", "max",   "p50", "p90",
+    "p99",  "p999",     "irtt", "ip50", "ip90", "ip99", "ip999", "lag_avg",
+    "lag_p99", "lag_max", "rto"};
+
+enum {
+  COL_TYPE,
+  COL_TIME,
+  COL_HOST,
+  COL_ADDR,
+  COL_SEQ,
+  COL_TTL,
+  COL_BYTES,
+  COL_RTT,
+  COL_STATUS,
+  COL_SENT,
+  COL_RECV,
+  COL_DUP,
+  COL_LOSS,
+  COL_MIN,
+  COL_AVG,
+  COL_MAX,
+  COL_P50,
+  COL_P90,
+  COL_P99,
+  COL_P999,
+  COL_IRTT,
+  COL_IP50,
+  COL_IP90,
+  COL_IP99,
+  COL_IP999,
+  COL_LAG_AVG,
+  COL_LAG_P99,
+  COL_LAG_MAX,
+  COL_RTO,
+  NCOLS
+};
+
+typedef struct record {
+  t_obuf *ob;
+  int format; /* FMT_JSON or FMT_CSV */
+  int col;    /* Last column written */
+} t_rec;
+
+static void rec_key(t_rec *r, int col) {
+  if (r->format == FMT_JSON) {
+    ob_puts(r->ob, ",\"");
+    ob_puts(r->ob, columns[col]);
+    ob_puts(r->ob, "\":");
+  } else {
+    for (; r->col < col; r->col++)
+      ob_putc(r->ob, ',');
+  }
+  r->col = col;
+}
+
+static void rec_str(t_rec *r, int col, const char *v) {
+  rec_key(r, col);
+  if (r->format == FMT_JSON)
+    ob_putjstr(r->ob, v);
+  else
+    ob_puts(r->ob, v);
+}
+
+static void rec_uint(t_rec *r, int col, uint64_t v) {
+  rec_key(r, col);
+  ob_putu(r->ob, v);
+}
+
+static void rec_fix(t_rec *r, int col, double v, int decimals) {
+  rec_key(r, col);
+  ob_putfix(r->ob, v, decimals);
+}
+
+static void rec_begin(t_rec *r, t_pset *s, const char *type) {
+  t_obuf *ob = &s->out;
+  struct timeval now;
+
+  r->ob = ob;
+  r->format = s->opt.format;
+  r->col = COL_TYPE;
+  ob_reserve(ob, OBUF_RECORD);
+  if (s->opt.format == FMT_JSON) {
+    ob_puts(ob, "{\"type\":");
+    ob_putjstr(ob, type);
+  } else
+    ob_puts(ob, type);
+
+  s->tp->wallclock(s, &now);
+  rec_fix(r, COL_TIME, now.tv_sec + now.tv_usec / 1e6, 6);
+}
+
+static void rec_end(t_rec *r) {
+  if (r->format == FMT_JSON)
+    ob_putc(r->ob, '}');
+  else
+    for (; r->col < NCOLS - 1; r->col++)
+      ob_putc(r->ob, ',');
+  ob_putc(r->ob, '\n');
+}
+
+static void rec_target(t_rec *r, t_pinfo *p) {
+  int json = r->format == FMT_JSON;
+
+  rec_str(r, COL_HOST, p->hostname);
+  rec_key(r, COL_ADDR);
+  if (json)
+    ob_putc(r->ob, '"');
+  ob_putip(r->ob, p->dst.sin_addr);
+  if (json)
+    ob_putc(r->ob, '"');
+}
+
+/* Probes lost, taken as the ones without a reply if not known */
+static void rec_stats(t_rec *r, size_t sent, size_t recv, size_t dup,
+                      size_t lost, t_pstat *st) {
+  size_t n = st->hist.count;
+
+  rec_uint(r, COL_SENT, sent);
+  rec_uint(r, COL_RECV, recv);
+  rec_uint(r, COL_DUP, dup);
+  if (lost == (size_t)-1)
+    lost = recv < sent ? sent - recv : 0;
+  if (sent)
+    rec_fix(r, COL_LOSS, MIN(lost, sent) * 100.0 / sent, 3);
+  if (!n)
+    return;
+  rec_fix(r, COL_MIN, st->tmin, 3);
+  rec_fix(r, COL_AVG, st->tsum / n, 3);
+  rec_fix(r, COL_MAX, st->tmax, 3);
+  rec_fix(r, COL_P50, stat_percentile(st, 50), 3);
+  rec_fix(r, COL_P90, stat_percentile(st, 90), 3);
+  rec_fix(r, COL_P99, stat_percentile(st, 99), 3);
+  rec_fix(r, COL_P999, stat_percentile(st, 99.9), 3);
+}
+
+int report_init(t_pset *s) {
+  if (s->opt.format == FMT_CSV && !s->shard) {
+    for (int i = 0; i < NCOLS; i++) {
+      if (i)
+        ob_putc(&s->out, ',');
+      ob_puts(&s->out, columns[i]);
+    }
+    ob_putc(&s->out, '\n');
+  }
+  /* Workers report on the targets of a sharded session */
+  if (s->opt.report_intvl && !s->nshards)
+    for (size_t i = 0; i < s->ntargets; i++) {
+      t_pinfo *p = &s->targets[i];
+
+      if (!(p->istat = calloc(1, sizeof(*p->istat))) || stat_init(p->istat)) {
+        perror("report_init failed");
+        return -1;
+      }
+    }
+  return 0;
+}
+
+void report_reply(t_pset *s, t_pinfo *p, struct ip *ip, icmphdr_t *icmp,
+                  unsigned int datalen, int seqclass, double triptime,
+                  double itriptime) {
+  static const char *status[] = {"ok", "reordered", "duplicate", "late"};
+  t_rec r;
+
+  rec_begin(&r, s, "reply");
+  rec_target(&r, p);
+  rec_uint(&r, COL_SEQ, icmp->icmp_seq);
+  rec_uint(&r, COL_TTL, ip->ip_ttl);
+  rec_uint(&r, COL_BYTES, datalen);
+  if (triptime >= 0)
+    rec_fix(&r, COL_RTT, triptime, 3);
+  rec_str(&r, COL_STATUS, status[seqclass]);
+  if (itriptime >= 0)
+    rec_fix(&r, COL_IRTT, itriptime, 3);
+  rec_end(&r);
+}
+
+void report_error(t_pset *s, t_pinfo *p, struct sockaddr_in *from,
+                  icmphdr_t *icmp) {
+  icmphdr_t *orig = (icmphdr_t *)(&icmp->icmp_ip + 1);
+  int json = s->opt.format == FMT_JSON;
+  t_rec r;
+
+  rec_begin(&r, s, "error");
+  rec_target(&r, p);
+  rec_uint(&r, COL_SEQ, orig->icmp_seq);
+  /* icmp-<type>-<code> from <addr>, nothing in it to escape */
+  rec_key(&r, COL_STATUS);
+  if (json)
+    ob_putc(r.ob, '"');
+  ob_puts(r.ob, "icmp-");
+  ob_putu(r.ob, icmp->icmp_type);
+  ob_putc(r.ob, '-');
+  ob_putu(r.ob, icmp->icmp_code);
+  ob_puts(r.ob, " from ");
+  ob_putip(r.ob, from->sin_addr);
+  if (json)
+    ob_putc(r.ob, '"');
+  rec_end(&r);
+}
+
+/* The probe has no round trip, only the time its reply was given */
+void report_timeout(t_pset *s, t_pinfo *p, t_pseqent *ent) {
+  t_rec r;
+
+  rec_begin(&r, s, "timeout");
+  rec_target(&r, p);
+  rec_uint(&r, COL_SEQ, ent->seq & 0xffff);
+  rec_str(&r, COL_STATUS, "lost");
+  rec_fix(&r, COL_RTO, ent->rto / 1000000.0, 3);
+  rec_end(&r);
+}
+
+/*
+ * Aggregate of the interval since the previous report, for every target
+ * that can be pinged.
+ * With per-probe timeouts, the loss is that of the probes which timed out
+ * during the interval rather than of those still waiting for a reply.
+ */
+void report_interval(t_pset *s) {
+  for (size_t i = 0; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[i];
+    t_rec r;
+
+    if (p->state != TARGET_LIVE)
+      continue;
+    rec_begin(&r, s, "interval");
+    rec_target(&r, p);
+    rec_stats(&r, p->num_xmit - p->inum_xmit, p->num_recv - p->inum_recv,
+              p->num_rept - p->inum_rept,
+              s->wheel ? p->win.lost - p->inum_lost : (size_t)-1, p->istat);
+    rec_end(&r);
+
+    p->inum_xmit = p->num_xmit;
+    p->inum_recv = p->num_recv;
+    p->inum_rept = p->num_rept;
+    p->inum_lost = p->win.lost;
+    stat_reset(p->istat);
+  }
+}
+
+void report_summary(t_pset *s, t_pinfo *p) {
+  t_rec r;
+
+  rec_begin(&r, s, "summary");
+  rec_target(&r, p);
+  rec_stats(&r, p->num_xmit, p->num_recv, p->num_rept, (size_t)-1, &p->stat);
+  if (p->ostat && p->ostat->hist.count) {
+    rec_fix(&r, COL_IP50, stat_percentile(p->ostat, 50), 3);
+    rec_fix(&r, COL_IP90, stat_percentile(p->ostat, 90), 3);
+    rec_fix(&r, COL_IP99, stat_percentile(p->ostat, 99), 3);
+    rec_fix(&r, COL_IP999, stat_percentile(p->ostat, 99.9), 3);
+  }
+  if (p->lag && p->lag->hist.count) {
+    rec_fix(&r, COL_LAG_AVG, p->lag->tsum / p->lag->hist.count, 3);
+    rec_fix(&r, COL_LAG_P99, stat_percentile(p->lag, 99), 3);
+    rec_fix(&r, COL_LAG_MAX, p->lag->tmax, 3);
+  }
+  rec_end(&r);
+}
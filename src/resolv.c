@@ -0,0 +1,228 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ping.h"
+
+/*
+ * Asynchronous reverse DNS.  Names live in a fixed cache of RESOLV_CACHE
+ * entries recycled in least recently used order; a miss queues the address
+ * for the resolver thread and is printed numerically until the lookup
+ * completes.  Nothing is allocated once the resolver is running.
+ */
+
+enum { RES_FREE, RES_PENDING, RES_DONE, RES_FAILED };
+
+typedef struct resolv_ent {
+  in_addr_t addr;
+  int state;
+  int hnext;      /* Next entry in the hash chain, -1 at the end */
+  int prev, next; /* LRU list neighbours, -1 at the ends */
+  char name[NI_MAXHOST];
+} t_present;
+
+struct ping_resolv {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int quit;     /* Resolver thread is to stop */
+  int busy;     /* Lookup in progress, outside the lock */
+  int detached; /* Resolver thread frees everything when done */
+
+  t_present ent[RESOLV_CACHE];
+  int hash[RESOLV_CACHE * 2]; /* First entry of every chain, -1 if empty */
+  int head, tail;             /* Most and least recently used entries */
+
+  in_addr_t queue[RESOLV_QUEUE]; /* Addresses waiting for the thread */
+  size_t qhead, qtail;
+};
+
+static unsigned int res_hash(in_addr_t addr) {
+  return (addr * 2654435761u) >> 16 & (RESOLV_CACHE * 2 - 1);
+}
+
+static t_present *res_find(t_presolv *r, in_addr_t addr) {
+  for (int i = r->hash[res_hash(addr)]; i >= 0; i = r->ent[i].hnext)
+    if (r->ent[i].addr == addr && r->ent[i].state != RES_FREE)
+      return &r->ent[i];
+  return NULL;
+}
+
+static void lru_unlink(t_presolv *r, t_present *e) {
+  if (e->prev >= 0)
+    r->ent[e->prev].next = e->next;
+  else
+    r->head = e->next;
+  if (e->next >= 0)
+    r->ent[e->next].prev = e->prev;
+  else
+    r->tail = e->prev;
+}
+
+static void lru_push(t_presolv *r, t_present *e) {
+  int i = e - r->ent;
+
+  e->prev = -1;
+  e->next = r->head;
+  if (r->head >= 0)
+    r->ent[r->head].prev = i;
+  r->head = i;
+  if (r->tail < 0)
+    r->tail = i;
+}
+
+static void hash_unlink(t_presolv *r, t_present *e) {
+  int *p = &r->hash[res_hash(e->addr)];
+
+  while (*p != e - r->ent)
+    p = &r->ent[*p].hnext;
+  *p = e->hnext;
+}
+
+/* Recycle the least recently used entry for addr */
+static t_present *res_insert(t_presolv *r, in_addr_t addr) {
+  t_present *e = &r->ent[r->tail];
+  unsigned int h = res_hash(addr);
+
+  lru_unlink(r, e);
+  if (e->state != RES_FREE)
+    hash_unlink(r, e);
+  e->addr = addr;
+  e->state = RES_PENDING;
+  e->hnext = r->hash[h];
+  r->hash[h] = e - r->ent;
+  lru_push(r, e);
+  return e;
+}
+
+static void res_destroy(t_presolv *r) {
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  free(r);
+}
+
+static void *res_main(void *arg) {
+  t_presolv *r = arg;
+  struct sockaddr_in sin = {.sin_family = AF_INET};
+  char name[NI_MAXHOST];
+  t_present *e;
+  int rc;
+
+  pthread_mutex_lock(&r->lock);
+  for (;;) {
+    while (!r->quit && r->qhead == r->qtail)
+      pthread_cond_wait(&r->cond, &r->lock);
+    if (r->quit)
+      break;
+    sin.sin_addr.s_addr = r->queue[r->qhead++ % RESOLV_QUEUE];
+    r->busy = 1;
+    pthread_mutex_unlock(&r->lock);
+
+    rc = getnameinfo((struct sockaddr *)&sin, sizeof(sin), name, sizeof(name),
+                     NULL, 0, NI_NAMEREQD);
+
+    pthread_mutex_lock(&r->lock);
+    r->busy = 0;
+    /* The entry may have been recycled in the meantime */
+    if ((e = res_find(r, sin.sin_addr.s_addr)) && e->state == RES_PENDING) {
+      e->state = rc ? RES_FAILED : RES_DONE;
+      if (!rc)
+        memcpy(e->name, name, sizeof(name));
+    }
+  }
+  rc = r->detached;
+  pthread_mutex_unlock(&r->lock);
+  if (rc)
+    res_destroy(r);
+  return NULL;
+}
+
+int resolv_init(t_pset *s) {
+  sigset_t all, old;
+  t_presolv *r;
+  int rc;
+
+  if (!(r = calloc(1, sizeof(*r)))) {
+    perror("resolv_init failed");
+    return -1;
+  }
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  memset(r->hash, -1, sizeof(r->hash));
+  r->head = r->tail = -1;
+  for (int i = 0; i < RESOLV_CACHE; i++)
+    lru_push(r, &r->ent[i]);
+
+  /* Signals are left to the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  rc = pthread_create(&r->thread, NULL, res_main, r);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc) {
+    fprintf(stderr, "resolv_init failed: %s\n", strerror(rc));
+    res_destroy(r);
+    return -1;
+  }
+  s->resolv = r;
+  return 0;
+}
+
+/*
+ * A lookup still in progress may take as long as the resolver timeouts:
+ * rather than waiting for it, the thread is left to clean up behind us.
+ */
+void resolv_free(t_pset *s) {
+  t_presolv *r = s->resolv;
+  int busy;
+
+  if (!r)
+    return;
+  pthread_mutex_lock(&r->lock);
+  r->quit = 1;
+  busy = r->detached = r->busy;
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  if (busy)
+    pthread_detach(r->thread);
+  else {
+    pthread_join(r->thread, NULL);
+    res_destroy(r);
+  }
+  s->resolv = NULL;
+}
+
+/*
+ * Format addr as "name (address)" if its name is known, or as the bare
+ * address otherwise, in which case a lookup is started.
+ */
+const char *resolv_name(t_pset *s, struct in_addr addr, char *buf,
+                        size_t size) {
+  t_presolv *r = s->resolv;
+  t_present *e;
+
+  if (!r) {
+    snprintf(buf, size, "%s", inet_ntoa(addr));
+    return buf;
+  }
+  pthread_mutex_lock(&r->lock);
+  if ((e = res_find(r, addr.s_addr))) {
+    lru_unlink(r, e);
+    lru_push(r, e);
+  } else if (r->qtail - r->qhead < RESOLV_QUEUE) {
+    res_insert(r, addr.s_addr);
+    r->queue[r->qtail++ % RESOLV_QUEUE] = addr.s_addr;
+    pthread_cond_signal(&r->cond);
+  }
+  if (e && e->state == RES_DONE)
+    snprintf(buf, size, "%s (%s)", e->name, inet_ntoa(addr));
+  else
+    snprintf(buf, size, "%s", inet_ntoa(addr));
+  pthread_mutex_unlock(&r->lock);
+  return buf;
+}
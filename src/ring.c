@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ping.h"
+
+/*
+ * Lock-free single producer, single consumer ring.  Each side only writes
+ * its own position; the positions grow forever and are reduced modulo the
+ * size when indexing.  Storing a position publishes the slots before it.
+ */
+
+int ring_init(t_pring *r, size_t size) {
+  memset(r, 0, sizeof(*r));
+  if (!(r->ev = calloc(size, sizeof(*r->ev))))
+    return -1;
+  r->size = size;
+  return 0;
+}
+
+void ring_free(t_pring *r) {
+  free(r->ev);
+  r->ev = NULL;
+}
+
+/* Copy an event in, fails if the ring is full */
+int ring_push(t_pring *r, const t_pevent *ev) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == r->size)
+    return -1;
+  r->ev[head & (r->size - 1)] = *ev;
+  atomic_store(&r->head, head + 1);
+  return 0;
+}
+
+/* Number of events the consumer may read */
+size_t ring_avail(t_pring *r) {
+  return atomic_load(&r->head) -
+         atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+t_pevent *ring_peek(t_pring *r, size_t i) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+  return &r->ev[(tail + i) & (r->size - 1)];
+}
+
+/* Hand the first n events back to the producer */
+void ring_release(t_pring *r, size_t n) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+  atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+}
@@ -0,0 +1,91 @@
+#include <sys/param.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ping.h"
+
+/*
+ * Per-probe timeouts.  Every target keeps a smoothed round trip and its
+ * variation the way TCP does (RFC 6298), and each probe it sends gets a
+ * deadline of srtt + 4 * rttvar, no less than the floor given with --rto.
+ * The deadlines sit in a timing wheel, so that arming, cancelling and
+ * expiring them is O(1) however many probes are in flight.  A probe whose
+ * deadline passes is accounted as lost there and then; a reply coming
+ * afterwards is a late one.  Every timeout doubles the next one, up to
+ * RTO_MAX, until a new round trip is measured.
+ */
+
+static long long rto_min(t_pset *s) { return s->opt.rto_min * 1000000LL; }
+
+int rto_init(t_pset *s) {
+  if (!(s->wheel = malloc(sizeof(*s->wheel)))) {
+    perror("rto_init failed");
+    return -1;
+  }
+  wheel_init(s->wheel, s->tp->clock(s) >> RTO_TICK_SHIFT);
+  for (size_t i = 0; i < s->ntargets; i++)
+    s->targets[i].rto = MAX(RTO_INIT * 1000000LL, rto_min(s));
+  return 0;
+}
+
+void rto_free(t_pset *s) {
+  free(s->wheel);
+  s->wheel = NULL;
+}
+
+/* Deadline of a probe just sent, replacing that of the slot's last one */
+void rto_arm(t_pset *s, t_pinfo *p, t_pseqent *ent) {
+  long long due = s->tp->clock(s) + p->rto;
+
+  wheel_del(s->wheel, &ent->timer);
+  ent->p = p;
+  ent->rto = p->rto;
+  /* Rounded up, a deadline never fires early */
+  wheel_add(s->wheel, &ent->timer, (due >> RTO_TICK_SHIFT) + 1);
+}
+
+void rto_cancel(t_pset *s, t_pseqent *ent) { wheel_del(s->wheel, &ent->timer); }
+
+void rto_sample(t_pset *s, t_pinfo *p, long long rtt) {
+  long long g = 1LL << RTO_TICK_SHIFT;
+
+  if (!p->srtt) {
+    p->srtt = rtt;
+    p->rttvar = rtt / 2;
+  } else {
+    p->rttvar += (llabs(p->srtt - rtt) - p->rttvar) / 4;
+    p->srtt += (rtt - p->srtt) / 8;
+  }
+  p->rto = p->srtt + MAX(g, 4 * p->rttvar);
+  p->rto = MIN(MAX(p->rto, rto_min(s)), RTO_MAX * 1000000LL);
+}
+
+static void rto_expire(t_wtimer *t, void *arg) {
+  t_pseqent *ent = (t_pseqent *)((char *)t - offsetof(t_pseqent, timer));
+  t_pset *s = arg;
+  t_pinfo *p = ent->p;
+
+  if (ent->state != PROBE_SENT)
+    return;
+  ent->state = PROBE_LOST;
+  p->win.lost++;
+  if (s->opt.format)
+    report_timeout(s, p, ent);
+  else if (!(s->opts & (OPT_QUIET | OPT_FLOOD)))
+    print_timeout(s, p, ent);
+  p->rto = MIN(p->rto * 2, RTO_MAX * 1000000LL);
+}
+
+/* Account every probe whose deadline has passed as lost */
+void rto_run(t_pset *s, long long now) {
+  wheel_run(s->wheel, now >> RTO_TICK_SHIFT, rto_expire, s);
+}
+
+/* Time by which rto_run() is due, 0 if no probe is waiting */
+long long rto_next(t_pset *s) {
+  uint64_t tick = wheel_next(s->wheel);
+
+  return tick == UINT64_MAX ? 0 : (long long)(tick << RTO_TICK_SHIFT);
+}
@@ -0,0 +1,143 @@
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ping.h"
+
+#define NITEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+/*
+ * Memory mapped receive ring (PACKET_MMAP, TPACKET_V3) on one interface.
+ * The kernel fills whole blocks of packets and hands them over at once;
+ * replies are decoded in place and the block is given back.  The raw socket
+ * is then only kept for sending and its error queue, so everything that
+ * would be queued on it is dropped by a filter.
+ */
+
+/* IPv4 ICMP, not sent by this host, until filter_attach() narrows it */
+static struct sock_filter ring_code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 2, 0),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct ip, ip_p)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0xffff),
+};
+
+static struct sock_filter drop_code[] = {
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static int attach(int fd, struct sock_filter *code, size_t len) {
+  struct sock_fprog prog = {.len = len, .filter = code};
+
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int rxring_init(t_pset *s, const char *iface) {
+  t_prxring *r = &s->ring;
+  struct tpacket_req3 req = {.tp_block_size = RXRING_BLOCK,
+                             .tp_block_nr = RXRING_NBLOCKS,
+                             .tp_frame_size = TPACKET_ALIGNMENT << 7,
+                             .tp_retire_blk_tov = 1};
+  struct sockaddr_ll sll = {.sll_family = AF_PACKET,
+                            .sll_protocol = htons(ETH_P_IP)};
+  int version = TPACKET_V3;
+
+  req.tp_frame_nr = req.tp_block_size / req.tp_frame_size * req.tp_block_nr;
+  if (!(sll.sll_ifindex = if_nametoindex(iface))) {
+    fprintf(stderr, "ft_ping: unknown interface %s\n", iface);
+    return -1;
+  }
+  /* Datagram sockets strip the link layer, packets start with IP */
+  if ((r->fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP))) < 0) {
+    perror("socket(AF_PACKET)");
+    return -1;
+  }
+  if (attach(r->fd, ring_code, NITEMS(ring_code)) < 0 ||
+      setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) < 0 ||
+      setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    perror("rxring_init failed");
+    return -1;
+  }
+  r->size = (size_t)req.tp_block_size * req.tp_block_nr;
+  r->map = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_LOCKED | MAP_POPULATE, r->fd, 0);
+  if (r->map == MAP_FAILED) {
+    r->map = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, 0);
+    if (r->map == MAP_FAILED) {
+      r->map = NULL;
+      perror("mmap failed");
+      return -1;
+    }
+  }
+  r->block_size = req.tp_block_size;
+  r->nblocks = req.tp_block_nr;
+  if (bind(r->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    perror("bind failed");
+    return -1;
+  }
+  if (attach(s->fd, drop_code, NITEMS(drop_code)) < 0) {
+    perror("setsockopt(SO_ATTACH_FILTER)");
+    return -1;
+  }
+  return 0;
+}
+
+void rxring_free(t_prxring *r) {
+  if (r->map)
+    munmap(r->map, r->size);
+  if (r->fd >= 0)
+    close(r->fd);
+  r->map = NULL;
+  r->fd = -1;
+}
+
+/* Decode every packet of every block the kernel has handed over */
+int rxring_recv(t_pset *s) {
+  t_prxring *r = &s->ring;
+  struct tpacket_block_desc *bd;
+  struct tpacket3_hdr *hdr;
+  int total = 0;
+
+  for (;;) {
+    bd = (struct tpacket_block_desc *)(r->map + r->cur * r->block_size);
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER))
+      break;
+
+    hdr = (struct tpacket3_hdr *)((unsigned char *)bd +
+                                  bd->hdr.bh1.offset_to_first_pkt);
+    for (uint32_t i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+      struct ip *ip = (struct ip *)((unsigned char *)hdr + hdr->tp_net);
+      struct sockaddr_in from = {.sin_family = AF_INET,
+                                 .sin_addr = ip->ip_src};
+      struct timespec ts = {.tv_sec = hdr->tp_sec, .tv_nsec = hdr->tp_nsec};
+      struct timeval tv = {.tv_sec = ts.tv_sec, .tv_usec = ts.tv_nsec / 1000};
+
+      /* The ring time stamp stands for the receive time */
+      ping_process(s, (unsigned char *)ip, hdr->tp_snaplen, &from,
+                   s->opts & OPT_KERNTS ? &ts : NULL, &tv);
+      hdr = (struct tpacket3_hdr *)((unsigned char *)hdr +
+                                    hdr->tp_next_offset);
+    }
+    total += bd->hdr.bh1.num_pkts;
+
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    if (++r->cur == r->nblocks)
+      r->cur = 0;
+  }
+  return total;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ping.h"
+
+/*
+ * Sequence window: the last `size' probes sent to a target, indexed by their
+ * extended sequence number.  Only the low 16 bits go on the wire; the rest is
+ * recovered from the number of probes sent so far, which is unambiguous as
+ * long as the window is smaller than the 16-bit sequence space.
+ */
+
+int seqwin_init(t_pseqwin *w, size_t size) {
+  memset(w, 0, sizeof(*w));
+  if (!(w->ent = calloc(size, sizeof(*w->ent))))
+    return -1;
+  w->size = size;
+  return 0;
+}
+
+void seqwin_free(t_pseqwin *w) {
+  free(w->ent);
+  w->ent = NULL;
+}
+
+static int seqwin_extend(t_pseqwin *w, unsigned short seq, size_t *ext) {
+  size_t e = (w->next & ~(size_t)0xffff) | seq;
+
+  if (e >= w->next) {
+    if (e < 0x10000)
+      return -1; /* never sent */
+    e -= 0x10000;
+  }
+  *ext = e;
+  return 0;
+}
+
+unsigned short seqwin_send(t_pseqwin *w, const struct timeval *sent,
+                           long long lag) {
+  t_pseqent *ent = &w->ent[w->next & (w->size - 1)];
+
+  /* Probe leaving the window without a reply */
+  if (ent->state == PROBE_SENT)
+    w->lost++;
+
+  ent->seq = w->next;
+  ent->state = PROBE_SENT;
+  ent->sent = sent->tv_sec * 1000000000LL + sent->tv_usec * 1000LL;
+  ent->txts = 0;
+  ent->lag = lag;
+  return w->next++ & 0xffff;
+}
+
+t_pseqent *seqwin_find(t_pseqwin *w, unsigned short seq) {
+  t_pseqent *ent;
+  size_t e;
+
+  if (seqwin_extend(w, seq, &e) || w->next - e > w->size)
+    return NULL;
+  ent = &w->ent[e & (w->size - 1)];
+  return ent->seq == e && ent->state != PROBE_FREE ? ent : NULL;
+}
+
+/* Entry the next probe sent will take over */
+t_pseqent *seqwin_next(t_pseqwin *w) {
+  return &w->ent[w->next & (w->size - 1)];
+}
+
+int seqwin_recv(t_pseqwin *w, unsigned short seq) {
+  t_pseqent *ent;
+  size_t e;
+
+  if (seqwin_extend(w, seq, &e))
+    return SEQ_BOGUS;
+  if (w->next - e > w->size) {
+    w->late++;
+    return SEQ_LATE;
+  }
+
+  ent = &w->ent[e & (w->size - 1)];
+  switch (ent->state) {
+  case PROBE_RECV:
+    return SEQ_DUP;
+  case PROBE_LOST:
+    ent->state = PROBE_RECV;
+    w->late++;
+    return SEQ_LATE;
+  case PROBE_SENT:
+    ent->state = PROBE_RECV;
+    if (e + 1 < w->top) {
+      w->reord++;
+      return SEQ_REORD;
+    }
+    w->top = e + 1;
+    return SEQ_OK;
+  }
+  return SEQ_BOGUS;
+}
+
+/* Account every probe still waiting for its reply as lost */
+void seqwin_finish(t_pseqwin *w) {
+  for (size_t i = 0; i < w->size; i++)
+    if (w->ent[i].state == PROBE_SENT) {
+      w->ent[i].state = PROBE_LOST;
+      w->lost++;
+    }
+}
@@ -0,0 +1,259 @@
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/prctl.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ping.h"
+
+/*
+ * Sharded sessions: the targets are dealt round-robin to worker sessions,
+ * each with its own socket, identifier, schedule, windows and statistics,
+ * and each run from a thread pinned to a CPU of its own.  Once they are
+ * joined, their per-target results are handed back to the parent, whose
+ * summary is then that of a single session.  Target j of worker k is target
+ * j * n + k of the parent.
+ *
+ * The workers share nothing in userspace, but the kernel delivery path
+ * depends on the sockets.  Every worker opens an ICMP datagram socket when
+ * the system allows it, and the kernel then hands each reply to the one
+ * socket owning its identifier.  Raw sockets each get a clone of every ICMP
+ * packet, which the filters of all workers but one then drop: the kernel
+ * work per reply grows with the number of workers, and scaling stays close
+ * to linear only as long as that is small next to the rest of a reply.
+ */
+
+typedef struct shard_arg {
+  t_pset *parent;
+  t_pset *s;
+  int cpu; /* CPU to run on, -1 for any */
+  pthread_t thread;
+  int rc;
+} t_sharg;
+
+/* Workers are opened along with the parent, while privilege is held */
+int shard_init(t_pset *s) {
+  t_popt opt = s->opt;
+
+  opt.shards = 0;
+  if (!(s->shards = calloc(s->opt.shards, sizeof(*s->shards)))) {
+    perror("shard_init failed");
+    return -1;
+  }
+  for (size_t i = 0; i < s->opt.shards; i++) {
+    t_pset *sh = &s->shards[i];
+
+    if (ping_init(sh, &opt, s->opts)) {
+      /* Partly set up, but nothing ping_reset() cannot undo */
+      s->nshards = i + 1;
+      return -1;
+    }
+    s->nshards = i + 1;
+    sh->shard = 1;
+    if (!i && !sh->dgram && !sh->sim && s->opts & OPT_VERBOSE)
+      fprintf(stderr, "ft_ping: raw sockets, every worker sees every reply\n");
+    if (sh->sim)
+      sim_stream(sh, i);
+    /* Seeded schedules are as independent between workers as random ones */
+    if (sh->opt.seed && !(sh->opt.seed ^= i * 0x9e3779b97f4a7c15ULL))
+      sh->opt.seed = 1;
+    if ((sh->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      perror("shard_init failed");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void shard_free(t_pset *s) {
+  for (size_t i = 0; i < s->nshards; i++)
+    ping_reset(&s->shards[i]);
+  free(s->shards);
+  s->shards = NULL;
+  s->nshards = 0;
+}
+
+/* Safe from a signal handler: the workers may be waiting on their sockets */
+void shard_stop(t_pset *s) {
+  for (size_t i = 0; i < s->nshards; i++) {
+    atomic_store(&s->shards[i].stop, 1);
+    if (s->shards[i].stopfd >= 0)
+      eventfd_write(s->shards[i].stopfd, 1);
+  }
+}
+
+/* Deal the resolved targets and the rate to the first n workers */
+static int shard_split(t_pset *s, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    t_pset *sh = &s->shards[k];
+    size_t len = s->ntargets / n + (k < s->ntargets % n);
+
+    if (!(sh->targets = calloc(len, sizeof(*sh->targets)))) {
+      perror("shard_split failed");
+      return -1;
+    }
+    for (size_t j = 0; j < len; j++) {
+      t_pinfo *p = &sh->targets[j];
+
+      p->dst = s->targets[j * n + k].dst;
+      if (!(p->hostname = strdup(s->targets[j * n + k].hostname))) {
+        perror("shard_split failed");
+        return -1;
+      }
+      sh->ntargets++;
+    }
+    /* Every target gets the same share of the rate, whichever worker it is */
+    sh->share = s->ntargets;
+    sh->cb = s->cb;
+  }
+  return 0;
+}
+
+/*
+ * Results of the workers, moved into the targets of the parent, and their
+ * schedules folded into one that ping_finish() can print.
+ */
+static void shard_merge(t_pset *s, size_t n) {
+  t_pacer *t = &s->pace;
+
+  if (s->opt.rate) {
+    t->num = 1000000000LL;
+    t->den = s->opt.rate;
+  } else {
+    t->num = s->opt.interval;
+    t->den = s->ntargets;
+  }
+  for (size_t k = 0; k < n; k++) {
+    t_pset *sh = &s->shards[k];
+    t_pacer *pt = &sh->pace;
+
+    for (size_t j = 0; j < sh->ntargets; j++) {
+      t_pinfo *src = &sh->targets[j];
+      t_pinfo *dst = &s->targets[j * n + k];
+
+      dst->num_sent = src->num_sent;
+      dst->num_xmit = src->num_xmit;
+      dst->num_recv = src->num_recv;
+      dst->num_rept = src->num_rept;
+      dst->num_err = src->num_err;
+      dst->stat = src->stat;
+      memset(&src->stat.hist, 0, sizeof(src->stat.hist));
+      dst->win = src->win;
+      memset(&src->win, 0, sizeof(src->win));
+      dst->srtt = src->srtt;
+      dst->rttvar = src->rttvar;
+      dst->rto = src->rto;
+      dst->ostat = src->ostat;
+      dst->lag = src->lag;
+      src->ostat = src->lag = NULL;
+    }
+    if (!pt->sent)
+      continue;
+    if (!t->sent || pt->first < t->first)
+      t->first = pt->first;
+    if (!t->sent || pt->last > t->last)
+      t->last = pt->last;
+    t->sent += pt->sent;
+    t->skipped += pt->skipped;
+  }
+}
+
+static void *shard_main(void *arg) {
+  t_sharg *a = arg;
+  t_pset *s = a->s;
+  cpu_set_t set;
+  int rc;
+
+  if (a->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(a->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  /* A thread of our own, which may tighten its timer slack */
+  prctl(PR_SET_TIMERSLACK, 1UL);
+  if (ping_setup(s) || ping_start(s)) {
+    /* The others would otherwise run on with a part of the targets */
+    shard_stop(a->parent);
+    a->rc = -1;
+    return NULL;
+  }
+  while (!(rc = ping_step(s)))
+    ;
+  pace_free(&s->pace);
+  ob_flush(&s->out);
+  a->rc = rc < 0 ? -1 : 0;
+  return NULL;
+}
+
+/* CPUs we may run on, in order */
+static size_t shard_cpus(int *cpus, size_t max) {
+  cpu_set_t set;
+  size_t n = 0;
+
+  if (sched_getaffinity(0, sizeof(set), &set))
+    return 0;
+  for (int c = 0; c < CPU_SETSIZE && n < max; c++)
+    if (CPU_ISSET(c, &set))
+      cpus[n++] = c;
+  return n;
+}
+
+int shard_exec(t_pset *s) {
+  t_sharg *args;
+  int cpus[CPU_SETSIZE];
+  size_t n, ncpus, started = 0;
+  sigset_t set, old;
+  int rc = 0;
+
+  if (dns_resolve(s))
+    return -1;
+  if (!s->ntargets) {
+    fprintf(stderr, "ft_ping: no destinations to ping\n");
+    return -1;
+  }
+  n = MIN(s->nshards, s->ntargets);
+  if (shard_split(s, n) ||
+      ob_init(&s->out, s->opt.out_fd, OBUF_SIZE) || report_init(s))
+    return -1;
+  ob_flush(&s->out);
+  if (!(args = calloc(n, sizeof(*args)))) {
+    perror("shard_exec failed");
+    return -1;
+  }
+  ncpus = shard_cpus(cpus, CPU_SETSIZE);
+
+  /* Interrupts are for the calling thread, which tells the workers */
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+  for (; started < n; started++) {
+    t_sharg *a = &args[started];
+
+    a->parent = s;
+    a->s = &s->shards[started];
+    a->cpu = ncpus ? cpus[started % ncpus] : -1;
+    if (pthread_create(&a->thread, NULL, shard_main, a)) {
+      perror("pthread_create failed");
+      shard_stop(s);
+      rc = -1;
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  for (size_t k = 0; k < started; k++) {
+    pthread_join(args[k].thread, NULL);
+    if (args[k].rc)
+      rc = -1;
+  }
+  free(args);
+
+  shard_merge(s, n);
+  ping_finish(s);
+  return rc;
+}
@@ -0,0 +1,363 @@
+#include <arpa/inet.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ping.h"
+
+/*
+ * Simulated network.  Every target answers from within the process: a probe
+ * handed to the transport is turned into its echo reply, or an ICMP error,
+ * and queued for delivery after a latency drawn from the configured
+ * distribution.  The clock is virtual and only moves when the send loop
+ * waits, jumping straight to the next delivery or send slot, so a run is
+ * deterministic for a given seed and takes no longer than it computes.
+ *
+ * The spec is a comma separated list of key=value pairs:
+ *   delay=<ms>    base one way latency of a round trip (default 1)
+ *   jitter=<ms>   spread of the latency added to the delay
+ *   dist=<name>   const, uniform (default), normal, exp or pareto
+ *   loss=<pct>    probes never answered
+ *   dup=<pct>     replies delivered twice
+ *   err=<pct>     probes answered with a host unreachable error
+ *   seed=<n>      random generator seed
+ */
+
+enum { DIST_CONST, DIST_UNIFORM, DIST_NORMAL, DIST_EXP, DIST_PARETO };
+
+#define SIM_PARETO_SHAPE 1.5 /* heavy tail, finite mean */
+
+typedef struct sim_pkt {
+  long long due;       /* Delivery time, ns */
+  size_t order;        /* Queue order, ties go to the first queued */
+  struct in_addr from; /* Sender */
+  size_t len;
+  unsigned char *data; /* Packet from the IP header */
+} t_simpkt;
+
+struct ping_sim {
+  long long now;   /* Virtual monotonic clock, ns */
+  long long wall;  /* Wall clock minus the monotonic one, ns */
+  uint64_t rand;   /* xorshift64* state */
+  int dist;        /* Latency distribution */
+  long long delay; /* ns */
+  long long jitter;
+  double loss; /* Probabilities, 0 to 1 */
+  double dup;
+  double err;
+  t_simpkt *heap; /* Packets in flight, min heap by due time */
+  size_t len;
+  size_t size;
+  size_t order;
+};
+
+/* Uniform in (0, 1) */
+static double rnd(t_psim *m) {
+  m->rand ^= m->rand >> 12;
+  m->rand ^= m->rand << 25;
+  m->rand ^= m->rand >> 27;
+  return ((m->rand * 0x2545f4914f6cdd1dULL >> 11) + 0.5) / (1ULL << 53);
+}
+
+static long long latency(t_psim *m) {
+  double j = m->jitter, x = 0;
+
+  switch (m->dist) {
+  case DIST_UNIFORM:
+    x = rnd(m) * j;
+    break;
+  case DIST_NORMAL:
+    x = j * sqrt(-2 * log(rnd(m))) * cos(2 * M_PI * rnd(m));
+    break;
+  case DIST_EXP:
+    x = -j * log(rnd(m));
+    break;
+  case DIST_PARETO:
+    x = j * (pow(rnd(m), -1 / SIM_PARETO_SHAPE) - 1);
+  }
+  return MAX(m->delay + (long long)x, 0);
+}
+
+static int before(const t_simpkt *a, const t_simpkt *b) {
+  return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static int sim_push(t_psim *m, t_simpkt *pkt) {
+  size_t i;
+
+  if (m->len == m->size) {
+    size_t size = m->size ? 2 * m->size : 256;
+    t_simpkt *heap = realloc(m->heap, size * sizeof(*heap));
+
+    if (!heap)
+      return -1;
+    m->heap = heap;
+    m->size = size;
+  }
+  pkt->order = m->order++;
+  for (i = m->len++; i && before(pkt, &m->heap[(i - 1) / 2]); i = (i - 1) / 2)
+    m->heap[i] = m->heap[(i - 1) / 2];
+  m->heap[i] = *pkt;
+  return 0;
+}
+
+static void sim_pop(t_psim *m, t_simpkt *pkt) {
+  t_simpkt *last = &m->heap[--m->len];
+  size_t i = 0, c;
+
+  *pkt = m->heap[0];
+  while ((c = 2 * i + 1) < m->len) {
+    if (c + 1 < m->len && before(&m->heap[c + 1], &m->heap[c]))
+      c++;
+    if (!before(&m->heap[c], last))
+      break;
+    m->heap[i] = m->heap[c];
+    i = c;
+  }
+  m->heap[i] = *last;
+}
+
+static void ip_header(struct ip *ip, size_t len, struct in_addr src,
+                      struct in_addr dst) {
+  memset(ip, 0, sizeof(*ip));
+  ip->ip_v = 4;
+  ip->ip_hl = sizeof(*ip) >> 2;
+  ip->ip_len = htons(len);
+  ip->ip_ttl = 64;
+  ip->ip_p = IPPROTO_ICMP;
+  ip->ip_src = src;
+  ip->ip_dst = dst;
+}
+
+/* Echo reply to the probe in pkt, as a raw socket would receive it */
+static unsigned char *reply(t_pinfo *p, unsigned char *pkt, size_t len,
+                            size_t *n) {
+  unsigned char *buf = malloc(sizeof(struct ip) + len);
+  icmphdr_t *icmp = (icmphdr_t *)(buf + sizeof(struct ip));
+  unsigned short old, new;
+
+  if (!buf)
+    return NULL;
+  *n = sizeof(struct ip) + len;
+  ip_header((struct ip *)buf, *n, p->dst.sin_addr, (struct in_addr){0});
+  memcpy(icmp, pkt, len);
+  memcpy(&old, icmp, sizeof(old));
+  icmp->icmp_type = ICMP_ECHOREPLY;
+  icmp->icmp_code = 0;
+  memcpy(&new, icmp, sizeof(new));
+  icmp->icmp_cksum = icmp_cksum_update(icmp->icmp_cksum, &old, &new, 2);
+  return buf;
+}
+
+/* Host unreachable quoting the header and first 8 bytes of the probe */
+static unsigned char *unreach(t_pinfo *p, unsigned char *pkt, size_t len,
+                              size_t *n) {
+  size_t quote = MIN(len, 8);
+  unsigned char *buf;
+  icmphdr_t *icmp;
+
+  *n = 2 * sizeof(struct ip) + ICMP_MINLEN + quote;
+  if (!(buf = malloc(*n)))
+    return NULL;
+  ip_header((struct ip *)buf, *n, p->dst.sin_addr, (struct in_addr){0});
+  icmp = (icmphdr_t *)(buf + sizeof(struct ip));
+  memset(icmp, 0, ICMP_MINLEN);
+  icmp->icmp_type = ICMP_DEST_UNREACH;
+  icmp->icmp_code = ICMP_HOST_UNREACH;
+  ip_header(&icmp->icmp_ip, sizeof(struct ip) + len, (struct in_addr){0},
+            p->dst.sin_addr);
+  memcpy(&icmp->icmp_ip + 1, pkt, quote);
+  icmp->icmp_cksum =
+      icmp_cksum((unsigned char *)icmp, *n - sizeof(struct ip));
+  return buf;
+}
+
+static int sim_send(t_pset *s, t_pinfo *p, unsigned char *pkt, size_t len) {
+  t_psim *m = s->sim;
+  int err = m->err && rnd(m) < m->err;
+  int copies = 1 + (m->dup && rnd(m) < m->dup);
+  t_simpkt in;
+
+  if (m->loss && rnd(m) < m->loss)
+    return len;
+  for (int i = 0; i < copies; i++) {
+    in.data = err ? unreach(p, pkt, len, &in.len) : reply(p, pkt, len, &in.len);
+    in.from = p->dst.sin_addr;
+    in.due = m->now + latency(m);
+    if (!in.data || sim_push(m, &in)) {
+      free(in.data);
+      return -1;
+    }
+  }
+  return len;
+}
+
+static int sim_flush(t_pset *s) {
+  t_pbatch *b = &s->tx;
+  t_pinfo *p;
+
+  for (size_t i = 0; i < b->len; i++) {
+    p = target_lookup(
+        s, ((struct sockaddr_in *)b->msgs[i].msg_hdr.msg_name)->sin_addr.s_addr);
+    sim_send(s, p, b->iovs[i].iov_base, b->iovs[i].iov_len);
+  }
+  b->len = 0;
+  return 0;
+}
+
+/* Deliver everything due until wake, then move the clock there */
+static int sim_wait(t_pset *s, t_pacer *pace __attribute__((unused)),
+                    long long wake) {
+  t_psim *m = s->sim;
+  struct sockaddr_in from = {.sin_family = AF_INET};
+  t_simpkt pkt;
+
+  while (m->len && m->heap[0].due <= wake) {
+    sim_pop(m, &pkt);
+    m->now = MAX(m->now, pkt.due);
+    from.sin_addr = pkt.from;
+    ping_process(s, pkt.data, pkt.len, &from, NULL, NULL);
+    free(pkt.data);
+    if (s->opt.count && atomic_load(&s->ndone) >= s->ntargets)
+      return 0;
+  }
+  m->now = MAX(m->now, wake);
+  return 0;
+}
+
+static long long sim_clock(t_pset *s) { return s->sim->now; }
+
+static void sim_wallclock(t_pset *s, struct timeval *tv) {
+  long long t = s->sim->now + s->sim->wall;
+
+  tv->tv_sec = t / 1000000000LL;
+  tv->tv_usec = t % 1000000000LL / 1000;
+}
+
+const t_ptransport sim_transport = {
+    .clock = sim_clock,
+    .wallclock = sim_wallclock,
+    .send = sim_send,
+    .flush = sim_flush,
+    .wait = sim_wait,
+};
+
+static int parse_ms(const char *v, long long *ns) {
+  char *end;
+  double ms = strtod(v, &end);
+
+  if (*end || end == v || ms < 0 || ms > 3600000)
+    return -1;
+  *ns = ms * 1000000.0 + 0.5;
+  return 0;
+}
+
+static int parse_pct(const char *v, double *p) {
+  char *end;
+  double pct = strtod(v, &end);
+
+  if (*end || end == v || pct < 0 || pct > 100)
+    return -1;
+  *p = pct / 100;
+  return 0;
+}
+
+static int parse_param(t_psim *m, char *key) {
+  static const char *dists[] = {"const", "uniform", "normal", "exp",
+                                "pareto"};
+  char *v = strchr(key, '='), *end;
+
+  if (!v)
+    return -1;
+  *v++ = '\0';
+  if (!strcmp(key, "delay"))
+    return parse_ms(v, &m->delay);
+  if (!strcmp(key, "jitter"))
+    return parse_ms(v, &m->jitter);
+  if (!strcmp(key, "loss"))
+    return parse_pct(v, &m->loss);
+  if (!strcmp(key, "dup"))
+    return parse_pct(v, &m->dup);
+  if (!strcmp(key, "err"))
+    return parse_pct(v, &m->err);
+  if (!strcmp(key, "seed")) {
+    m->rand = strtoull(v, &end, 0);
+    return *end || end == v ? -1 : 0;
+  }
+  if (!strcmp(key, "dist")) {
+    for (size_t i = 0; i < sizeof(dists) / sizeof(*dists); i++)
+      if (!strcmp(v, dists[i])) {
+        m->dist = i;
+        return 0;
+      }
+  }
+  return -1;
+}
+
+int sim_init(t_pset *s, const char *spec) {
+  struct timespec mono, real;
+  char *buf, *tok, *save;
+  t_psim *m;
+
+  if (!(m = calloc(1, sizeof(*m))) || !(buf = strdup(spec))) {
+    free(m);
+    perror("sim_init failed");
+    return -1;
+  }
+  m->delay = 1000000;
+  m->dist = DIST_UNIFORM;
+  m->rand = 1;
+  for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    if (parse_param(m, tok)) {
+      fprintf(stderr, "ft_ping: invalid simulation parameter `%s'\n", tok);
+      free(buf);
+      free(m);
+      return -1;
+    }
+  free(buf);
+  /* Zero would be a fixed point of the generator */
+  if (!m->rand)
+    m->rand = 1;
+
+  /*
+   * The virtual clocks start at the real ones, on a whole microsecond so
+   * that the timestamps carried by the probes round the same every run.
+   */
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+  mono.tv_nsec -= mono.tv_nsec % 1000;
+  real.tv_nsec -= real.tv_nsec % 1000;
+  m->now = mono.tv_sec * 1000000000LL + mono.tv_nsec;
+  m->wall = real.tv_sec * 1000000000LL + real.tv_nsec - m->now;
+  s->start_time = mono;
+  s->sim = m;
+  s->tp = &sim_transport;
+  s->id = 0x5173;
+  return 0;
+}
+
+/* Independent stream of the same seed, for the workers of a sharded session */
+void sim_stream(t_pset *s, uint64_t stream) {
+  t_psim *m = s->sim;
+
+  m->rand ^= stream * 0x9e3779b97f4a7c15ULL;
+  if (!m->rand)
+    m->rand = 1;
+}
+
+void sim_free(t_pset *s) {
+  t_psim *m = s->sim;
+
+  if (!m)
+    return;
+  for (size_t i = 0; i < m->len; i++)
+    free(m->heap[i].data);
+  free(m->heap);
+  free(m);
+  s->sim = NULL;
+}
@@ -0,0 +1,99 @@
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+
+#include "ping.h"
+
+/*
+ * Socket transport: the host's network, its clocks and the descriptors the
+ * send loop sleeps on.  In threaded mode the socket is left to the receive
+ * thread, and with io_uring the wait is a timeout request completing along
+ * with the receives.
+ */
+
+static long long sock_clock(t_pset *s __attribute__((unused))) {
+  return mono_ns();
+}
+
+static void sock_wallclock(t_pset *s __attribute__((unused)),
+                           struct timeval *tv) {
+  gettimeofday(tv, NULL);
+}
+
+static int sock_send(t_pset *s, t_pinfo *p, unsigned char *pkt, size_t len) {
+  return sendto(s->fd, (char *)pkt, len, 0, (struct sockaddr *)&p->dst,
+                sizeof(struct sockaddr_in));
+}
+
+/*
+ * Packets the kernel refuses are not requeued: they already own their
+ * sequence numbers, so they are failed one by one and the rest of the batch
+ * still goes out.  The flush fails only if nothing did.
+ */
+static int sock_flush(t_pset *s) {
+  t_pbatch *b = &s->tx;
+  size_t off = 0, failed = 0;
+  int ret;
+
+  if (s->uring)
+    return uring_send(s);
+  while (off < b->len) {
+    ret = sendmmsg(s->fd, b->msgs + off, b->len - off, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("sendmmsg failed");
+      batch_fail(s, off++);
+      failed++;
+      continue;
+    }
+    off += ret;
+  }
+  b->len = 0;
+  return failed < off ? 0 : -1;
+}
+
+static int sock_wait(t_pset *s, t_pacer *pace, long long wake) {
+  int threads = s->opts & OPT_THREADS;
+  struct pollfd pfd[4] = {{.fd = threads ? -1 : s->fd, .events = POLLIN},
+                          {.fd = pace->fd, .events = POLLIN},
+                          {.fd = s->stopfd, .events = POLLIN},
+                          {.fd = threads ? -1 : s->ring.fd, .events = POLLIN}};
+  int rc;
+
+  if (s->uring)
+    return uring_wait(s, wake);
+  if (pace_arm(pace, wake) < 0) {
+    perror("timerfd_settime failed");
+    return -1;
+  }
+  if ((rc = ppoll(pfd, 4, NULL, NULL)) < 0) {
+    if (errno != EINTR)
+      perror("poll failed");
+    return 0;
+  }
+  if (pfd[2].revents)
+    return 1;
+  if (pfd[0].revents & POLLERR)
+    tstamp_drain(s);
+  if (pfd[0].revents & POLLIN) {
+    if (s->rx.size)
+      batch_recv(s);
+    else
+      ping_recv(s);
+  }
+  if (pfd[3].revents & POLLIN)
+    rxring_recv(s);
+  return 0;
+}
+
+const t_ptransport sock_transport = {
+    .clock = sock_clock,
+    .wallclock = sock_wallclock,
+    .send = sock_send,
+    .flush = sock_flush,
+    .wait = sock_wait,
+};
@@ -0,0 +1,62 @@
+#include <sys/param.h>
+
+#include <string.h>
+
+#include "ping.h"
+
+/* The histogram is allocated here, never while recording */
+int stat_init(t_pstat *st) {
+  memset(st, 0, sizeof(*st));
+  st->tmin = 999999999.0;
+  return hist_init(&st->hist);
+}
+
+/* Start over, keeping the histogram allocated */
+void stat_reset(t_pstat *st) {
+  t_hist hist = st->hist;
+
+  hist_reset(&hist);
+  memset(st, 0, sizeof(*st));
+  st->tmin = 999999999.0;
+  st->hist = hist;
+}
+
+/* A clock stepping back can make a round trip negative: count it as 0 */
+void stat_add(t_pstat *st, double triptime) {
+  if (triptime < 0)
+    triptime = 0;
+  st->tsum += triptime;
+  st->tsumsq += triptime * triptime;
+  if (triptime < st->tmin)
+    st->tmin = triptime;
+  if (triptime > st->tmax)
+    st->tmax = triptime;
+  hist_add(&st->hist, triptime * 1000000.0);
+}
+
+void stat_merge(t_pstat *dst, const t_pstat *src) {
+  dst->tsum += src->tsum;
+  dst->tsumsq += src->tsumsq;
+  if (src->tmin < dst->tmin)
+    dst->tmin = src->tmin;
+  if (src->tmax > dst->tmax)
+    dst->tmax = src->tmax;
+  dst->osum += src->osum;
+  if (src->omax > dst->omax)
+    dst->omax = src->omax;
+  dst->nkern += src->nkern;
+  hist_merge(&dst->hist, &src->hist);
+}
+
+/* Percentile in ms, kept within the exact extremes */
+double stat_percentile(const t_pstat *st, double pct) {
+  double v = hist_percentile(&st->hist, pct) / 1000000.0;
+
+  return MIN(MAX(v, st->tmin), st->tmax);
+}
+
+/* Statistics may be freed whether they were allocated or not */
+void stat_free(t_pstat *st) {
+  if (st)
+    hist_free(&st->hist);
+}
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <error.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ping.h"
+
+/*
+ * Targets are kept in a flat array which is indexed by an open addressing
+ * hash on the destination address once all of them are added, so that
+ * replies can be matched without scanning the whole set.  Targets named by
+ * host name join the hash as their name resolves.
+ */
+
+static size_t addr_hash(in_addr_t addr, size_t hsize) {
+  return ((unsigned int)addr * 2654435761u) & (hsize - 1);
+}
+
+int target_add(t_pset *s, const char *host) {
+  t_pinfo *targets, *p;
+
+  targets = realloc(s->targets, (s->ntargets + 1) * sizeof(*targets));
+  if (!targets) {
+    perror("target_add failed");
+    return -1;
+  }
+  s->targets = targets;
+  p = &targets[s->ntargets];
+  memset(p, 0, sizeof(*p));
+  if (set_dest(p, host)) {
+    perror("target_add failed");
+    return -1;
+  }
+  s->ntargets++;
+  return 0;
+}
+
+int target_load(t_pset *s, const char *path) {
+  FILE *f;
+  char line[1024];
+  int rc = 0;
+
+  if (!(f = fopen(path, "r"))) {
+    error(0, errno, "%s", path);
+    return -1;
+  }
+
+  while (rc >= 0 && fgets(line, sizeof(line), f)) {
+    char *host = line + strspn(line, " \t");
+
+    host[strcspn(host, " \t\r\n#")] = 0;
+    if (*host)
+      rc = target_add(s, host);
+  }
+  fclose(f);
+  return rc < 0 ? rc : 0;
+}
+
+static void target_insert(t_pset *s, size_t i) {
+  size_t h;
+
+  for (h = addr_hash(s->targets[i].dst.sin_addr.s_addr, s->hsize); s->htab[h];
+       h = (h + 1) & (s->hsize - 1))
+    ;
+  s->htab[h] = i + 1;
+}
+
+/* The hash is sized for every target, those still waiting for their name too */
+int target_index(t_pset *s) {
+  size_t i, n;
+
+  for (s->hsize = 1; s->hsize < 2 * s->ntargets;)
+    s->hsize <<= 1;
+  if (!(s->htab = calloc(s->hsize, sizeof(*s->htab)))) {
+    perror("target_index failed");
+    return -1;
+  }
+
+  for (i = n = 0; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[i];
+
+    if (p->state == TARGET_LIVE && target_lookup(s, p->dst.sin_addr.s_addr)) {
+      fprintf(stderr, "ft_ping: duplicate destination %s ignored\n",
+              p->hostname);
+      free(p->hostname);
+      continue;
+    }
+    s->targets[n] = *p;
+    if (p->state == TARGET_LIVE)
+      target_insert(s, n);
+    n++;
+  }
+  s->ntargets = n;
+  return 0;
+}
+
+/* A target whose name has just resolved, unless another one has its address */
+int target_activate(t_pset *s, t_pinfo *p) {
+  if (target_lookup(s, p->dst.sin_addr.s_addr)) {
+    fprintf(stderr, "ft_ping: duplicate destination %s ignored\n",
+            p->hostname);
+    p->state = TARGET_DEAD;
+    return -1;
+  }
+  target_insert(s, p - s->targets);
+  p->state = TARGET_LIVE;
+  return 0;
+}
+
+t_pinfo *target_lookup(t_pset *s, in_addr_t addr) {
+  size_t h;
+
+  for (h = addr_hash(addr, s->hsize); s->htab[h];
+       h = (h + 1) & (s->hsize - 1)) {
+    t_pinfo *p = &s->targets[s->htab[h] - 1];
+
+    if (p->dst.sin_addr.s_addr == addr)
+      return p;
+  }
+  return NULL;
+}
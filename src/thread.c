@@ -0,0 +1,211 @@
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/prctl.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "ping.h"
+
+/*
+ * Threaded engine: a transmit thread runs the send schedule, a receive
+ * thread reads the socket, and the calling thread consumes their events to
+ * do the accounting and all of the output.  A slow terminal only delays the
+ * consumer; the network threads block only if a ring fills up.
+ */
+
+typedef struct tx_arg {
+  t_pset *s;
+  t_pacer *pace;
+  int (*run)(t_pset *, t_pacer *);
+  int rc;
+} t_txarg;
+
+void ping_event(t_pset *s, t_pevent *ev) {
+  t_pring *r;
+
+  if (!(s->opts & OPT_THREADS)) {
+    ping_account(s, ev);
+    return;
+  }
+  r = ev->type == EV_SEND || ev->type == EV_FAIL ? &s->txq : &s->rxq;
+  while (ring_push(r, ev)) {
+    if (atomic_load(&s->quit))
+      return;
+    sched_yield();
+  }
+  if (atomic_exchange(&s->sleeping, 0))
+    eventfd_write(s->wakefd, 1);
+}
+
+/* Have both network threads stop, once */
+static void thread_quit(t_pset *s) {
+  if (!atomic_exchange(&s->quit, 1))
+    eventfd_write(s->stopfd, 1);
+}
+
+static void *tx_main(void *arg) {
+  t_txarg *a = arg;
+
+  /* Our own thread: the default slack of 50us would dwarf short periods */
+  prctl(PR_SET_TIMERSLACK, 1UL);
+  a->rc = a->run(a->s, a->pace);
+  atomic_store(&a->s->txdone, 1);
+  eventfd_write(a->s->wakefd, 1);
+  return NULL;
+}
+
+static void *rx_main(void *arg) {
+  t_pset *s = arg;
+  struct pollfd pfd[3] = {{.fd = s->fd, .events = POLLIN},
+                          {.fd = s->stopfd, .events = POLLIN},
+                          {.fd = s->ring.fd, .events = POLLIN}};
+
+  for (;;) {
+    if (poll(pfd, 3, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll failed");
+      break;
+    }
+    if (pfd[1].revents)
+      break;
+    /* Transmit timestamps go ahead of the replies they belong to */
+    if (s->opts & OPT_KERNTS || pfd[0].revents & POLLERR)
+      tstamp_drain(s);
+    if (pfd[0].revents & POLLIN) {
+      if (s->rx.size)
+        batch_recv(s);
+      else
+        ping_recv(s);
+    }
+    if (pfd[2].revents & POLLIN)
+      rxring_recv(s);
+  }
+  return NULL;
+}
+
+/*
+ * Sends are accounted before the replies that follow them: a reply is only
+ * received after its send event was pushed, so taking the receive snapshot
+ * first is enough.
+ */
+static void consume(t_pset *s) {
+  size_t nrx = ring_avail(&s->rxq);
+  size_t ntx = ring_avail(&s->txq);
+
+  for (size_t i = 0; i < ntx; i++)
+    ping_account(s, ring_peek(&s->txq, i));
+  ring_release(&s->txq, ntx);
+  for (size_t i = 0; i < nrx; i++)
+    ping_account(s, ring_peek(&s->rxq, i));
+  ring_release(&s->rxq, nrx);
+}
+
+/*
+ * With --rto the run is over once every probe has its reply or has timed
+ * out, however long after the last send that is.
+ */
+static int thread_pending(t_pset *s) {
+  return s->wheel && s->wheel->len && !atomic_load(&s->quit);
+}
+
+/* Wait for events, until the given time if not zero */
+static void consume_wait(t_pset *s, long long until) {
+  struct pollfd pfd = {.fd = s->wakefd, .events = POLLIN};
+  struct timespec ts, *tp = NULL;
+  sigset_t unblocked;
+  eventfd_t n;
+
+  atomic_store(&s->sleeping, 1);
+  if (!ring_avail(&s->rxq) && !ring_avail(&s->txq) &&
+      (!atomic_load(&s->txdone) || thread_pending(s))) {
+    if (until) {
+      long long left = MAX(until - mono_ns(), 0);
+
+      ts.tv_sec = left / 1000000000LL;
+      ts.tv_nsec = left % 1000000000LL;
+      tp = &ts;
+    }
+    /* Interrupts are only let in while waiting */
+    pthread_sigmask(SIG_SETMASK, NULL, &unblocked);
+    sigdelset(&unblocked, SIGINT);
+    if (ppoll(&pfd, 1, tp, &unblocked) > 0)
+      eventfd_read(s->wakefd, &n);
+  }
+  atomic_store(&s->sleeping, 0);
+}
+
+int thread_exec(t_pset *s, t_pacer *pace, int (*run)(t_pset *, t_pacer *)) {
+  t_txarg arg = {.s = s, .pace = pace, .run = run};
+  long long report = s->opt.report_intvl * 1000000000LL;
+  long long next_report = 0, until, deadline = 0;
+  pthread_t tx, rx;
+  sigset_t set, old;
+
+  if (ring_init(&s->txq, RING_SIZE) || ring_init(&s->rxq, RING_SIZE) ||
+      (s->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+      (s->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    perror("thread_exec failed");
+    return -1;
+  }
+
+  /* Interrupts are for the consumer, which tells the others to stop */
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+  if (pthread_create(&rx, NULL, rx_main, s)) {
+    perror("pthread_create failed");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return -1;
+  }
+  if (pthread_create(&tx, NULL, tx_main, &arg)) {
+    perror("pthread_create failed");
+    thread_quit(s);
+    pthread_join(rx, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return -1;
+  }
+
+  if (report)
+    next_report = mono_ns() + report;
+  /* The transmit thread may be done long before the last timeout */
+  if (s->opt.timeout)
+    deadline = s->start_time.tv_sec * 1000000000LL + s->start_time.tv_nsec +
+               s->opt.timeout * 1000000000LL;
+  for (;;) {
+    consume(s);
+    if (s->wheel)
+      rto_run(s, s->tp->clock(s));
+    if (report && mono_ns() >= next_report) {
+      report_interval(s);
+      next_report += report;
+    }
+    if (atomic_load(&s->stop) ||
+        (s->opt.count && atomic_load(&s->ndone) >= s->ntargets) ||
+        (deadline && mono_ns() >= deadline))
+      thread_quit(s);
+    if (atomic_load(&s->txdone) && !ring_avail(&s->txq) && !thread_pending(s))
+      break;
+    if (s->out.len)
+      ob_flush(&s->out);
+    until = s->wheel ? rto_next(s) : 0;
+    if (next_report && (!until || next_report < until))
+      until = next_report;
+    if (deadline && (!until || deadline < until))
+      until = deadline;
+    consume_wait(s, until);
+  }
+
+  thread_quit(s);
+  pthread_join(tx, NULL);
+  pthread_join(rx, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  consume(s);
+  return arg.rc;
+}
@@ -0,0 +1,109 @@
+#include <sys/socket.h>
+#include <time.h>
+
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icmp.h"
+#include "ping.h"
+
+/*
+ * Kernel software timestamps (SO_TIMESTAMPING).  Receive timestamps come
+ * with every reply as a control message, transmit timestamps are looped back
+ * on the socket error queue along with a copy of the sent packet, which is
+ * how they are matched to a target and sequence number.
+ */
+
+int tstamp_init(t_pset *s) {
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+              SOF_TIMESTAMPING_SOFTWARE;
+
+  if (setsockopt(s->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) <
+      0) {
+    perror("setsockopt(SO_TIMESTAMPING)");
+    return -1;
+  }
+  return 0;
+}
+
+int tstamp_rx(struct msghdr *msg, struct timespec *ts) {
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SO_TIMESTAMPING) {
+      struct scm_timestamping tss;
+
+      memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+      if (!tss.ts[0].tv_sec && !tss.ts[0].tv_nsec)
+        return 0;
+      *ts = tss.ts[0];
+      return 1;
+    }
+  return 0;
+}
+
+int tstamp_tx(t_pinfo *p, unsigned short seq, long long *ts) {
+  t_pseqent *ent = seqwin_find(&p->win, seq);
+
+  if (!ent || !ent->txts)
+    return 0;
+  *ts = ent->txts;
+  return 1;
+}
+
+/*
+ * The looped packet starts with the link layer header, whose length depends
+ * on the device, so the IP header is located from the end of the packet: we
+ * never send IP options, so it is always 20 bytes long.
+ */
+static void tstamp_store(t_pset *s, unsigned char *buf, size_t n,
+                         struct timespec *ts) {
+  size_t len = sizeof(struct ip) + s->data_size + 8;
+  struct ip *ip;
+  icmphdr_t *icmp;
+  t_pevent ev;
+
+  if (n < len)
+    return;
+  ip = (struct ip *)(buf + n - len);
+  icmp = (icmphdr_t *)(ip + 1);
+  if (ip->ip_v != 4 || ip->ip_p != IPPROTO_ICMP ||
+      icmp->icmp_type != ICMP_ECHO || icmp->icmp_id != s->id)
+    return;
+  if (!(ev.p = target_lookup(s, ip->ip_dst.s_addr)))
+    return;
+  ev.type = EV_TXTS;
+  ev.seq = icmp->icmp_seq;
+  ev.ts = *ts;
+  ping_event(s, &ev);
+}
+
+void tstamp_drain(t_pset *s) {
+  unsigned char buf[128 + MAXIPLEN + MAXICMPLEN + 65535];
+  unsigned char ctl[CTL_SIZE];
+  struct sockaddr_in name;
+  struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  struct timespec ts;
+  ssize_t n;
+
+  for (;;) {
+    msg.msg_name = &name;
+    msg.msg_namelen = sizeof(name);
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    n = recvmsg(s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (n < 0)
+      break;
+    if (s->dgram && dgram_error(s, &msg, buf, n))
+      continue;
+    if (tstamp_rx(&msg, &ts))
+      tstamp_store(s, buf, n, &ts);
+  }
+}
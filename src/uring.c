@@ -0,0 +1,382 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ping.h"
+
+/*
+ * io_uring backend, through the raw system calls.  A multishot receive stays
+ * armed on the socket and picks its buffers from a provided buffer ring, so
+ * replies keep coming without resubmission.  Sends of a flushed batch are
+ * submitted at once, and the wait for the next send slot is an absolute
+ * timeout request rather than a poll timeout.
+ */
+
+/*
+ * Completions are told apart by the low byte of their user data, the rest
+ * being an argument: the batch slot of a send, the generation of a timeout.
+ */
+enum { UD_RECV = 1, UD_SEND, UD_TIMEOUT, UD_POLL, UD_REMOVE };
+
+#define UD(type, arg) ((type) | (unsigned long long)(arg) << 8)
+
+struct ping_uring {
+  int fd;
+  unsigned char *sq_ring; /* Submission queue ring, shared with the CQ */
+  unsigned char *cq_ring; /* Completion queue ring */
+  size_t sq_size;
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned pending; /* Requests queued but not submitted */
+
+  struct io_uring_buf_ring *br; /* Provided receive buffers */
+  size_t br_size;
+  unsigned char *bufs;
+  size_t bufsize;
+  int recv_armed;
+
+  struct msghdr msg;           /* Multishot receive template */
+  struct __kernel_timespec ts; /* Pending timeout */
+  long long armed;             /* When it expires, 0 if none */
+  unsigned long long gen;      /* Generation of the last timeout armed */
+  size_t inflight;             /* Sends not completed yet */
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n) {
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static int submit(t_puring *u, unsigned wait) {
+  int ret;
+
+  do
+    ret = sys_enter(u->fd, u->pending, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0);
+  while (ret < 0 && errno == EINTR && !wait);
+  if (ret >= 0)
+    u->pending -= ret;
+  return ret;
+}
+
+static struct io_uring_sqe *get_sqe(t_puring *u) {
+  unsigned tail = *u->sq_tail;
+  struct io_uring_sqe *sqe;
+
+  if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+    submit(u, 0);
+  sqe = &u->sqes[tail & *u->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->pending++;
+  return sqe;
+}
+
+static void buf_recycle(t_puring *u, unsigned bid) {
+  unsigned short tail = u->br->tail;
+  struct io_uring_buf *b = &u->br->bufs[tail & (URING_NBUFS - 1)];
+
+  b->addr = (unsigned long)(u->bufs + bid * u->bufsize);
+  b->len = u->bufsize;
+  b->bid = bid;
+  __atomic_store_n(&u->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void arm_recv(t_pset *s) {
+  t_puring *u = s->uring;
+  struct io_uring_sqe *sqe = get_sqe(u);
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = s->fd;
+  sqe->addr = (unsigned long)&u->msg;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = UD_RECV;
+  u->recv_armed = 1;
+}
+
+/* Error queue activity: transmit timestamps, or errors on ping sockets */
+static void arm_poll(t_pset *s) {
+  struct io_uring_sqe *sqe = get_sqe(s->uring);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = s->fd;
+  sqe->poll32_events = POLLERR;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = UD_POLL;
+}
+
+int uring_init(t_pset *s) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  t_puring *u;
+
+  if (!(s->uring = u = calloc(1, sizeof(*u))))
+    goto err;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+            IORING_SETUP_DEFER_TASKRUN;
+  p.cq_entries = URING_CQ_SIZE;
+  if ((u->fd = sys_setup(URING_SQ_SIZE, &p)) < 0) {
+    /* Before Linux 6.1 */
+    p.flags = IORING_SETUP_CQSIZE;
+    if ((u->fd = sys_setup(URING_SQ_SIZE, &p)) < 0)
+      goto err;
+  }
+
+  u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->sq_size = u->cq_size = MAX(u->sq_size, u->cq_size);
+  u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+    goto err;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->cq_ring = u->sq_ring;
+  else if ((u->cq_ring = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, u->fd,
+                              IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto err;
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto err;
+
+  u->sq_head = (unsigned *)(u->sq_ring + p.sq_off.head);
+  u->sq_tail = (unsigned *)(u->sq_ring + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(u->sq_ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(u->sq_ring + p.sq_off.array);
+  u->sq_entries = p.sq_entries;
+  u->cq_head = (unsigned *)(u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned *)(u->cq_ring + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(u->cq_ring + p.cq_off.cqes);
+
+  /* Receive buffers: header, source address, control data, then the packet
+   * with room in front of it for the IP header of datagram replies */
+  u->msg.msg_namelen = sizeof(struct sockaddr_in);
+  u->msg.msg_controllen = CTL_SIZE;
+  u->bufsize = sizeof(struct io_uring_recvmsg_out) +
+               sizeof(struct sockaddr_in) + CTL_SIZE + BUFFER_SIZE(s);
+  u->br_size = URING_NBUFS * sizeof(struct io_uring_buf);
+  u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->br == MAP_FAILED || !(u->bufs = malloc(URING_NBUFS * u->bufsize)))
+    goto err;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)u->br;
+  reg.ring_entries = URING_NBUFS;
+  reg.bgid = 0;
+  if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    goto err;
+  for (unsigned i = 0; i < URING_NBUFS; i++)
+    buf_recycle(u, i);
+
+  arm_recv(s);
+  arm_poll(s);
+  if (submit(u, 0) < 0)
+    goto err;
+  return 0;
+err:
+  perror("uring_init failed");
+  return -1;
+}
+
+void uring_free(t_pset *s) {
+  t_puring *u = s->uring;
+
+  if (!u)
+    return;
+  if (u->sqes && u->sqes != MAP_FAILED)
+    munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_size);
+  if (u->sq_ring && u->sq_ring != MAP_FAILED)
+    munmap(u->sq_ring, u->sq_size);
+  if (u->br && u->br != MAP_FAILED)
+    munmap(u->br, u->br_size);
+  free(u->bufs);
+  if (u->fd >= 0)
+    close(u->fd);
+  free(u);
+  s->uring = NULL;
+}
+
+/* Hand a received buffer over to ping_process() */
+static void uring_packet(t_pset *s, unsigned bid, int res) {
+  t_puring *u = s->uring;
+  unsigned char *buf = u->bufs + bid * u->bufsize;
+  struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+  unsigned char *name = buf + sizeof(*out);
+  unsigned char *pkt = name + u->msg.msg_namelen + u->msg.msg_controllen;
+  struct msghdr msg = {.msg_control = name + u->msg.msg_namelen,
+                       .msg_controllen = out->controllen};
+  struct sockaddr_in from;
+  struct timespec rxts;
+  size_t len;
+  int ts;
+
+  if ((size_t)res < (size_t)(pkt - buf) || out->namelen < sizeof(from))
+    return;
+  /* Truncated payloads are reported with their full length */
+  len = MIN(out->payloadlen, res - (size_t)(pkt - buf));
+  memcpy(&from, name, sizeof(from));
+  ts = tstamp_rx(&msg, &rxts);
+
+  /* The IP header of datagram replies overwrites the end of the control
+   * data, which has been read by then */
+  if (s->dgram) {
+    pkt -= sizeof(struct ip);
+    len = dgram_header(pkt, len, &from, &msg);
+  }
+  ping_process(s, pkt, len, &from, ts ? &rxts : NULL, NULL);
+}
+
+/* Process every completion posted so far */
+static int uring_reap(t_pset *s) {
+  t_puring *u = s->uring;
+  unsigned head = *u->cq_head;
+  int err = 0;
+
+  while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+    switch (cqe->user_data & 0xff) {
+    case UD_RECV:
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (cqe->res > 0)
+          uring_packet(s, bid, cqe->res);
+        buf_recycle(u, bid);
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        u->recv_armed = 0;
+        /* Running out of buffers is the only error rearming cures */
+        if (cqe->res < 0 && cqe->res != -ENOBUFS)
+          err = -cqe->res;
+      }
+      break;
+    case UD_SEND:
+      /* Like with sendmmsg(), refused packets are failed one by one */
+      if (cqe->res < 0) {
+        fprintf(stderr, "sendmsg failed: %s\n", strerror(-cqe->res));
+        batch_fail(s, cqe->user_data >> 8);
+      }
+      u->inflight--;
+      break;
+    case UD_TIMEOUT:
+      /* Timeouts replaced by an earlier one complete as cancelled */
+      if (cqe->user_data >> 8 == u->gen)
+        u->armed = 0;
+      break;
+    case UD_POLL:
+      tstamp_drain(s);
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        arm_poll(s);
+      break;
+    }
+    __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+  }
+  if (err) {
+    /* Such as a kernel without multishot receives */
+    fprintf(stderr, "io_uring recvmsg failed: %s\n", strerror(err));
+    return -1;
+  }
+  if (!u->recv_armed)
+    arm_recv(s);
+  return 0;
+}
+
+/*
+ * Submit the queued batch, then wait for it to complete: the packets live
+ * in the pool slots, which are reused as soon as this returns.
+ */
+int uring_send(t_pset *s) {
+  t_puring *u = s->uring;
+  t_pbatch *b = &s->tx;
+
+  for (size_t i = 0; i < b->len; i++) {
+    struct io_uring_sqe *sqe = get_sqe(u);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = s->fd;
+    sqe->addr = (unsigned long)&b->msgs[i].msg_hdr;
+    sqe->len = 1;
+    sqe->user_data = UD(UD_SEND, i);
+    u->inflight++;
+  }
+  b->len = 0;
+  if (submit(u, 0) < 0) {
+    perror("io_uring_enter failed");
+    return -1;
+  }
+  if (uring_reap(s))
+    return -1;
+  while (u->inflight) {
+    if (submit(u, 1) < 0 && errno != EINTR) {
+      perror("io_uring_enter failed");
+      return -1;
+    }
+    if (uring_reap(s))
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Wait until the given time or for some completion, and process them.  A
+ * pending timeout that is later than the wake up is removed rather than left
+ * to pile up with the new one.
+ */
+int uring_wait(t_pset *s, long long wake) {
+  t_puring *u = s->uring;
+  struct io_uring_sqe *sqe;
+
+  if (!u->armed || wake < u->armed) {
+    if (u->armed) {
+      sqe = get_sqe(u);
+      sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+      sqe->addr = UD(UD_TIMEOUT, u->gen);
+      sqe->user_data = UD_REMOVE;
+    }
+    sqe = get_sqe(u);
+    u->ts.tv_sec = wake / 1000000000LL;
+    u->ts.tv_nsec = wake % 1000000000LL;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&u->ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = UD(UD_TIMEOUT, ++u->gen);
+    u->armed = wake;
+  }
+  if (submit(u, 1) < 0 && errno != EINTR && errno != ETIME) {
+    perror("io_uring_enter failed");
+    return -1;
+  }
+  return uring_reap(s);
+}
@@ -6,23 +6,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "icmp.h"
 #include "ping.h"
 
-static int create_socket(void) {
+/*
+ * Unprivileged ICMP datagram socket if the system allows it to our group,
+ * raw socket otherwise.
+ */
+static int create_socket(t_pset *s) {
+  static atomic_uint sessions;
   int fd;
-  struct protoent *proto;
 
-  proto = getprotobyname("icmp");
-  if (!proto) {
-    fprintf(stderr, "ft_ping: unknown protocol icmp.\n");
-    return -1;
+  if ((fd = dgram_open(&s->id)) >= 0) {
+    s->dgram = 1;
+    return fd;
   }
-  fd = socket(AF_INET, SOCK_RAW, proto->p_proto);
+  /* Raw sockets see every reply: sessions of a process need their own ids */
+  s->id = (getpid() + atomic_fetch_add(&sessions, 1) * 0x3b9) & 0xFFFF;
+  fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
   if (fd < 0) {
     if (errno == EPERM || errno == EACCES)
       fprintf(stderr, "ft_ping: Lacking privilege for icmp socket.\n");
@@ -31,160 +38,390 @@ static int create_socket(void) {
   return fd;
 }
 
-int ping_init(t_pinfo *p) {
-  memset(p, 0, sizeof(*p));
-  if ((p->fd = create_socket()) < 0)
+static void socket_options(t_pset *s) {
+  int one = 1;
+
+  setsockopt(s->fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+  if (s->opt.socket_type != 0)
+    setsockopt(s->fd, SOL_SOCKET, s->opt.socket_type, &one, sizeof(one));
+  if (s->opt.ttl > 0 && setsockopt(s->fd, IPPROTO_IP, IP_TTL, &s->opt.ttl,
+                                   sizeof(s->opt.ttl)) < 0)
+    perror("setsockopt(IP_TTL)");
+  if (s->opt.tos >= 0 && setsockopt(s->fd, IPPROTO_IP, IP_TOS, &s->opt.tos,
+                                    sizeof(s->opt.tos)) < 0)
+    perror("setsockopt(IP_TOS)");
+}
+
+/* Session with the given options, and the defaults that depend on them */
+int ping_init(t_pset *s, const t_popt *opt, size_t opts) {
+  memset(s, 0, sizeof(*s));
+  s->opt = *opt;
+  s->opts = opts;
+  s->opt.data = NULL;
+  if (!s->opt.interval)
+    s->opt.interval = (opts & OPT_FLOOD ? FLOOD_INTVL : DFLT_INTVL) * 1000000LL;
+  if (!s->opt.batch && (opts & OPT_FLOOD || s->opt.preload))
+    s->opt.batch = BATCH_DFLT;
+  s->wakefd = s->stopfd = s->ring.fd = s->pace.fd = -1;
+  s->data_size = s->opt.data_size;
+  clock_gettime(CLOCK_MONOTONIC, &s->start_time);
+  /* The parent of a sharded session has no network of its own */
+  if (s->opt.shards > 1) {
+    s->fd = -1;
+    s->tp = &sock_transport;
+    return shard_init(s);
+  }
+  if (s->opt.sim) {
+    s->fd = -1;
+    return sim_init(s, s->opt.sim);
+  }
+  s->tp = &sock_transport;
+  if ((s->fd = create_socket(s)) < 0)
     return -1;
-  p->id = getpid() & 0xFFFF;
-  p->data_size = opt_vals.data_size;
-  clock_gettime(CLOCK_MONOTONIC, &p->start_time);
+  socket_options(s);
   return 0;
 }
 
-void ping_reset(t_pinfo *p) {
-  free(p->buffer);
-  free(p->cktab);
-  free(p->hostname);
+void ping_reset(t_pset *s) {
+  /* Resolver threads read the names of the targets */
+  dns_free(s);
+  for (size_t i = 0; i < s->ntargets; i++) {
+    t_pinfo *p = &s->targets[i];
+
+    seqwin_free(&p->win);
+    stat_free(&p->stat);
+    stat_free(p->istat);
+    stat_free(p->ostat);
+    stat_free(p->lag);
+    free(p->istat);
+    free(p->ostat);
+    free(p->lag);
+    free(p->hostname);
+  }
+  free(s->targets);
+  free(s->htab);
+  free(s->buffer);
+  free(s->opt.data);
+  batch_free(&s->tx);
+  batch_free(&s->rx);
+  pool_free(s);
+  ob_free(&s->out);
+  rxring_free(&s->ring);
+  uring_free(s);
+  sim_free(s);
+  resolv_free(s);
+  capture_close(s);
+  ring_free(&s->txq);
+  ring_free(&s->rxq);
+  if (s->wakefd >= 0)
+    close(s->wakefd);
+  if (s->stopfd >= 0)
+    close(s->stopfd);
+  if (s->fd >= 0)
+    close(s->fd);
+  pace_free(&s->pace);
+  rto_free(s);
+  shard_free(s);
 }
 
-int buffer_init(t_pinfo *p) {
+int buffer_init(t_pset *s) {
+  size_t window = s->opt.window;
+
+  if (!window)
+    window = s->ntargets > 1 ? SEQWIN_MULTI : SEQWIN_DFLT;
+  for (size_t i = 0; i < s->ntargets; i++)
+    if (seqwin_init(&s->targets[i].win, window))
+      goto err;
+  if (s->opt.open_loop)
+    for (size_t i = 0; i < s->ntargets; i++) {
+      t_pinfo *p = &s->targets[i];
 
-  if (!(p->cktab = malloc(CKTAB_SIZE)))
+      if (!(p->ostat = calloc(1, sizeof(*p->ostat))) ||
+          !(p->lag = calloc(1, sizeof(*p->lag))) || stat_init(p->ostat) ||
+          stat_init(p->lag))
+        goto err;
+    }
+  if (!(s->buffer = malloc(BUFFER_SIZE(s))))
     goto err;
-  memset(p->cktab, 0, CKTAB_SIZE);
-  if (!(p->buffer = malloc(BUFFER_SIZE(p))))
+  memset(s->buffer, 0, BUFFER_SIZE(s));
+  if (ob_init(&s->out, s->opt.out_fd, OBUF_SIZE))
+    return -1;
+  /* io_uring sends from the transmit batch and has its own receive buffers */
+  if ((s->opt.batch > 1 || s->opts & OPT_URING) &&
+      batch_init(&s->tx, MAX(s->opt.batch, 1), 0))
     goto err;
-  memset(p->buffer, 0, BUFFER_SIZE(p));
-  return 0;
+  if (s->opt.batch > 1 && !(s->opts & OPT_URING) &&
+      batch_init(&s->rx, s->opt.batch, BUFFER_SIZE(s)))
+    goto err;
+  /* Room for the IP header added to datagram replies */
+  if (s->dgram)
+    for (size_t i = 0; i < s->rx.size; i++) {
+      s->rx.iovs[i].iov_base = (char *)s->rx.iovs[i].iov_base +
+                               sizeof(struct ip);
+      s->rx.iovs[i].iov_len -= sizeof(struct ip);
+    }
+  return pool_init(s);
 err:
   perror("buffer_init failed");
   return -1;
 }
 
-int data_init() {
+int data_init(t_pset *s) {
   size_t i = 0;
   unsigned char *p;
 
-  if (!(opt_vals.data = malloc(opt_vals.data_size)))
+  if (!(s->opt.data = malloc(s->opt.data_size)))
     goto err;
 
-  if (opt_vals.ptrn_size) {
-    for (p = opt_vals.data; p < opt_vals.data + opt_vals.data_size; p++) {
-      *p = opt_vals.ptrn[i];
-      if (++i >= opt_vals.ptrn_size)
+  if (s->opt.ptrn_size) {
+    for (p = s->opt.data; p < s->opt.data + s->opt.data_size; p++) {
+      *p = s->opt.ptrn[i];
+      if (++i >= s->opt.ptrn_size)
         i = 0;
     }
   } else {
-    for (i = 0; i < opt_vals.data_size; i++)
-      opt_vals.data[i] = i;
+    for (i = 0; i < s->opt.data_size; i++)
+      s->opt.data[i] = i;
   }
+
+  /* Sum of the part of the data that follows the timestamp */
+  s->opt.data_sum = icmp_cksum_add(
+      0, s->opt.data,
+      s->opt.data_size -
+          (TIMING(s->opt.data_size) ? sizeof(struct timeval) : 0));
   return 0;
 err:
   perror("data_init failed");
   return -1;
 }
 
-int ping_xmit(t_pinfo *p) {
-  ssize_t ret;
-  ssize_t buflen = p->data_size + 8;
+long long mono_ns(void) {
+  struct timespec now;
 
-  /* Mark sequence number as sent */
-  CKTAB_CLR(p, p->num_xmit);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-  /* Encode ICMP header */
-  icmp_echo_encode(p->buffer, buflen, p->id, p->num_xmit);
+int ping_xmit(t_pset *s, t_pinfo *p, unsigned char *pkt) {
+  ssize_t ret;
+  ssize_t buflen = s->data_size + 8;
 
-  ret = sendto(p->fd, (char *)p->buffer, buflen, 0, (struct sockaddr *)&p->dst,
-               sizeof(struct sockaddr_in));
-  if (ret < 0)
+  ret = s->tp->send(s, p, pkt, buflen);
+  if (ret < 0) {
+    /* Nothing left, do not wait for a reply */
+    t_pevent ev = {.type = EV_FAIL,
+                   .p = p,
+                   .seq = ((icmphdr_t *)pkt)->icmp_seq};
+
+    ping_event(s, &ev);
     return -1;
-  else {
-    p->num_xmit++;
-    if (ret != buflen)
-      printf("ping: wrote %s %zu chars, ret=%zd\n", p->hostname, p->data_size,
-             ret);
-  }
+  } else if (ret != buflen)
+    fprintf(stderr, "ping: wrote %s %zu chars, ret=%zd\n", p->hostname,
+            s->data_size, ret);
   return 0;
 }
 
-static int my_echo_reply(t_pinfo *p, icmphdr_t *icmp) {
+static int my_echo_reply(t_pset *s, t_pinfo *p, icmphdr_t *icmp) {
   struct ip *orig_ip = &icmp->icmp_ip;
   icmphdr_t *orig_icmp = (icmphdr_t *)(orig_ip + 1);
 
   return (orig_ip->ip_dst.s_addr == p->dst.sin_addr.s_addr &&
           orig_ip->ip_p == IPPROTO_ICMP && orig_icmp->icmp_type == ICMP_ECHO &&
-          orig_icmp->icmp_id == p->id);
+          orig_icmp->icmp_id == s->id);
 }
 
-int ping_recv(t_pinfo *p) {
-  socklen_t fromlen = sizeof(p->from);
-  int n, rc;
-  icmphdr_t *icmp;
-  struct ip *ip;
-  int dupflag;
+int ping_recv(t_pset *s) {
+  size_t off = s->dgram ? sizeof(struct ip) : 0;
+  unsigned char ctl[CTL_SIZE];
+  struct iovec iov = {.iov_base = s->buffer + off,
+                      .iov_len = BUFFER_SIZE(s) - off};
+  struct msghdr msg = {.msg_name = &s->from,
+                       .msg_namelen = sizeof(s->from),
+                       .msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctl,
+                       .msg_controllen = sizeof(ctl)};
+  struct timespec rxts;
+  int n;
 
-  n = recvfrom(p->fd, (char *)p->buffer, BUFFER_SIZE(p), 0,
-               (struct sockaddr *)&p->from, &fromlen);
+  n = recvmsg(s->fd, &msg, 0);
   if (n < 0)
     return -1;
+  if (s->dgram)
+    n = dgram_header(s->buffer, n, &s->from, &msg);
+  return ping_process(s, s->buffer, n, &s->from,
+                      tstamp_rx(&msg, &rxts) ? &rxts : NULL, NULL);
+}
 
-  rc = icmp_generic_decode(p->buffer, n, &ip, &icmp);
+/*
+ * Network side of a received packet: check that it answers one of our
+ * probes and hand its head over to the accounting side.  The packet was
+ * received at rxtv, or just now if NULL.
+ */
+int ping_process(t_pset *s, unsigned char *buffer, int n,
+                 struct sockaddr_in *from, const struct timespec *rxts,
+                 const struct timeval *rxtv) {
+  t_pevent ev;
+  icmphdr_t *icmp;
+  struct ip *ip;
+  t_pinfo *p;
+  int rc;
+
+  /* Datagram sockets only get replies the kernel has verified */
+  if (s->dgram && s->ring.fd < 0)
+    rc = icmp_generic_parse(buffer, n, &ip, &icmp);
+  else
+    rc = icmp_generic_decode(buffer, n, &ip, &icmp);
   if (rc < 0) {
     /*FIXME: conditional */
     fprintf(stderr, "packet too short (%d bytes) from %s\n", n,
-            inet_ntoa(p->from.sin_addr));
+            inet_ntoa(from->sin_addr));
     return -1;
   }
   switch (icmp->icmp_type) {
   case ICMP_ECHOREPLY:
-
-    if (icmp->icmp_id != p->id)
+    if (icmp->icmp_id != s->id)
+      return -1;
+    if (!(p = target_lookup(s, from->sin_addr.s_addr)))
       return -1;
-
     if (rc)
       fprintf(stderr, "checksum mismatch from %s\n",
-              inet_ntoa(p->from.sin_addr));
-
-    p->num_recv++;
-    if (CKTAB_TST(p, icmp->icmp_seq)) {
-      p->num_rept++;
-      p->num_recv--;
-      dupflag = 1;
-    } else {
-      CKTAB_SET(p, icmp->icmp_seq);
-      dupflag = 0;
-    }
-    print_echo(dupflag, &p->from, ip, icmp, n);
+              inet_ntoa(from->sin_addr));
     break;
-
   case ICMP_ECHO:
     return -1;
   default:
-    if (!my_echo_reply(p, icmp))
+    if (!(p = target_lookup(s, icmp->icmp_ip.ip_dst.s_addr)) ||
+        !my_echo_reply(s, p, icmp))
       return -1;
-    print_icmp_header(&p->from, ip, icmp, n);
   }
+
+  ev.type = EV_PKT;
+  ev.p = p;
+  if (rxtv)
+    ev.tv = *rxtv;
+  else
+    s->tp->wallclock(s, &ev.tv);
+  if (rxts)
+    ev.ts = *rxts;
+  else
+    ev.ts.tv_sec = ev.ts.tv_nsec = 0;
+  ev.from = *from;
+  ev.len = n;
+  memcpy(ev.pkt, ip, MIN((size_t)n, sizeof(ev.pkt)));
+  ping_event(s, &ev);
   return 0;
 }
 
+/* Accounting side of a received packet */
+static void ping_reply(t_pset *s, t_pevent *ev) {
+  struct ip *ip = (struct ip *)ev->pkt;
+  icmphdr_t *icmp = (icmphdr_t *)(ev->pkt + (ip->ip_hl << 2));
+  t_pinfo *p = ev->p;
+  long long rxts = ev->ts.tv_sec * 1000000000LL + ev->ts.tv_nsec;
+  long long txts;
+  double ktrip = -1, lag = -1;
+  t_pseqent *ent;
+  int seqclass;
+
+  if (icmp->icmp_type == ICMP_ECHOREPLY) {
+    /* The transmit timestamp may still sit on the error queue */
+    if (rxts && (tstamp_tx(p, icmp->icmp_seq, &txts) ||
+                 (!(s->opts & OPT_THREADS) &&
+                  (tstamp_drain(s), tstamp_tx(p, icmp->icmp_seq, &txts)))))
+      ktrip = (rxts - txts) / 1000000.0;
+
+    ent = seqwin_find(&p->win, icmp->icmp_seq);
+    if (p->ostat && ent)
+      lag = ent->lag / 1000000.0;
+    seqclass = seqwin_recv(&p->win, icmp->icmp_seq);
+    if (seqclass == SEQ_BOGUS)
+      return;
+    /* Only the first reply to a probe still waited for is a sample */
+    if (s->wheel && ent && ent->timer.pprev) {
+      rto_cancel(s, ent);
+      if (ktrip >= 0)
+        rto_sample(s, p, ktrip * 1000000.0);
+      else
+        rto_sample(s, p, ev->tv.tv_sec * 1000000000LL +
+                             ev->tv.tv_usec * 1000LL - ent->sent);
+    }
+    /* A late reply answers a probe already counted as lost */
+    if (seqclass == SEQ_DUP)
+      p->num_rept++;
+    else if (seqclass != SEQ_LATE)
+      p->num_recv++;
+    print_echo(s, p, seqclass, &ev->from, ip, icmp, ev->len, &ev->tv, ktrip,
+               lag);
+  } else {
+    p->num_err++;
+    if (s->cb.error) {
+      icmphdr_t *orig = (icmphdr_t *)(&icmp->icmp_ip + 1);
+      t_fterror e = {.host = p->hostname,
+                     .addr = p->dst.sin_addr,
+                     .from = ev->from.sin_addr,
+                     .type = icmp->icmp_type,
+                     .code = icmp->icmp_code,
+                     .seq = orig->icmp_seq};
+
+      s->cb.error(s, &e, s->cb.arg);
+    }
+    if (s->opt.format)
+      report_error(s, p, &ev->from, icmp);
+    else
+      print_icmp_header(s, &ev->from, ip, icmp, ev->len);
+  }
+  if (s->opt.count &&
+      p->num_recv + p->num_rept + p->win.late + p->num_err == s->opt.count)
+    atomic_fetch_add(&s->ndone, 1);
+}
+
+void ping_account(t_pset *s, t_pevent *ev) {
+  t_pinfo *p = ev->p;
+  t_pseqent *ent;
+  unsigned short seq;
+
+  if (s->cap)
+    capture_event(s, ev);
+  switch (ev->type) {
+  case EV_SEND:
+    /*
+     * A send may still fail after its EV_SEND, so the lag of a probe is
+     * only a sample once its entry is taken over, or at the end.
+     */
+    if (p->lag && (ent = seqwin_next(&p->win))->state != PROBE_FREE)
+      stat_add(p->lag, ent->lag / 1000000.0);
+    seq = seqwin_send(&p->win, &ev->tv, ev->lag);
+    if (s->wheel)
+      rto_arm(s, p, seqwin_find(&p->win, seq));
+    p->num_xmit++;
+    if (!(s->opts & OPT_QUIET) && s->opts & OPT_FLOOD && !s->opt.format)
+      ob_putc(&s->out, '.');
+    break;
+  case EV_FAIL:
+    if ((ent = seqwin_find(&p->win, ev->seq))) {
+      ent->state = PROBE_FREE;
+      if (s->wheel)
+        rto_cancel(s, ent);
+    }
+    p->num_xmit--;
+    break;
+  case EV_TXTS:
+    if ((ent = seqwin_find(&p->win, ev->seq)))
+      ent->txts = ev->ts.tv_sec * 1000000000LL + ev->ts.tv_nsec;
+    break;
+  case EV_PKT:
+    ping_reply(s, ev);
+  }
+}
+
+/* Addresses are taken as they are, names are left to dns_start() */
 int set_dest(t_pinfo *p, const char *host) {
   struct sockaddr_in *dst = &p->dst;
 
-  dst->sin_family = AF_INET;
   if (inet_aton(host, &dst->sin_addr))
-    p->hostname = strdup(host);
-  else {
-    struct hostent *hp;
-    hp = gethostbyname(host);
-    if (!hp)
-      return 1;
-
-    dst->sin_family = hp->h_addrtype;
-    if (hp->h_length > (int)sizeof(dst->sin_addr))
-      hp->h_length = sizeof(dst->sin_addr);
-
-    memcpy(&dst->sin_addr, hp->h_addr, hp->h_length);
-    p->hostname = strdup(hp->h_name);
-  }
-  return 0;
+    dst->sin_family = AF_INET;
+  else
+    p->state = TARGET_PENDING;
+  return (p->hostname = strdup(host)) ? 0 : -1;
 }
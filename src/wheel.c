@@ -0,0 +1,93 @@
+#include <string.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+void wheel_init(t_wheel *w, uint64_t now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+/*
+ * Lowest level whose span covers the time left.  A slot of level n is run
+ * when the clock reaches its start, which is never after the expiry of the
+ * timers it holds.
+ */
+static void wheel_link(t_wheel *w, t_wtimer *t) {
+  uint64_t e = t->expire > w->now ? t->expire : w->now;
+  t_wtimer **slot;
+  int l = 0;
+
+  if (e - w->now >= WHEEL_SPAN)
+    e = w->now + WHEEL_SPAN - 1;
+  while (l < WHEEL_LEVELS - 1 && e - w->now >= 1ULL << (WHEEL_BITS * (l + 1)))
+    l++;
+  slot = &w->slots[l][(e >> (WHEEL_BITS * l)) & WHEEL_MASK];
+  if ((t->next = *slot))
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+}
+
+void wheel_add(t_wheel *w, t_wtimer *t, uint64_t expire) {
+  t->expire = expire;
+  wheel_link(w, t);
+  w->len++;
+}
+
+void wheel_del(t_wheel *w, t_wtimer *t) {
+  if (!t->pprev)
+    return;
+  if ((*t->pprev = t->next))
+    t->next->pprev = t->pprev;
+  t->pprev = NULL;
+  w->len--;
+}
+
+/* Spread a slot of an upper level over the levels below */
+static void wheel_cascade(t_wheel *w, int l) {
+  t_wtimer **slot = &w->slots[l][(w->now >> (WHEEL_BITS * l)) & WHEEL_MASK];
+  t_wtimer *t = *slot, *next;
+
+  *slot = NULL;
+  for (; t; t = next) {
+    next = t->next;
+    wheel_link(w, t);
+  }
+}
+
+/* Fire every timer due at or before now, in tick order */
+void wheel_run(t_wheel *w, uint64_t now, void (*fire)(t_wtimer *, void *),
+               void *arg) {
+  t_wtimer *t;
+
+  for (; w->now <= now; w->now++) {
+    if (!w->len) {
+      w->now = now + 1;
+      return;
+    }
+    for (int l = 1; l < WHEEL_LEVELS &&
+                    !(w->now & ((1ULL << (WHEEL_BITS * l)) - 1));
+         l++)
+      wheel_cascade(w, l);
+    while ((t = w->slots[0][w->now & WHEEL_MASK])) {
+      wheel_del(w, t);
+      fire(t, arg);
+    }
+  }
+}
+
+/*
+ * Tick at which wheel_run() may have something to do: the first busy slot
+ * of this turn of level 0, or the start of a turn, where the levels above
+ * are spread.  UINT64_MAX if there is no timer at all.
+ */
+uint64_t wheel_next(t_wheel *w) {
+  if (!w->len)
+    return UINT64_MAX;
+  for (uint64_t t = w->now;; t++)
+    if (!(t & WHEEL_MASK) || w->slots[0][t & WHEEL_MASK])
+      return t;
+}